@@ -0,0 +1,381 @@
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "RangeAllocator.hpp"
+
+
+// Drives the buffer allocator bookkeeping without a GPU, either with
+// synthetic churn or with a trace recorded by running the demo with
+// GLDEMO_ALLOC_TRACE set.
+//
+//   AllocatorBench             run every synthetic workload
+//   AllocatorBench trace.txt   replay a recorded trace
+
+
+namespace {
+
+
+typedef std::chrono::steady_clock Clock;
+
+
+// The TLSF allocator BufferAllocator uses, growing like it does
+class TlsfStrategy {
+public:
+    typedef RangeAllocator::Region * Handle;
+
+    static const char * name() {
+        return "tlsf";
+    }
+
+    explicit TlsfStrategy(unsigned size) :
+        _ranges(size) {
+    }
+
+    Handle allocate(unsigned sz) {
+        RangeAllocator::Region * region = _ranges.allocate(sz);
+        if (!region) {
+            _ranges.grow(std::max(_ranges.size() * 2, _ranges.size() + sz));
+            region = _ranges.allocate(sz);
+        }
+        return region;
+    }
+
+    void free(Handle handle) {
+        _ranges.free(handle);
+    }
+
+    double fragmentation() const {
+        unsigned freeBytes = _ranges.freeBytes();
+        return freeBytes ? 1.0 - double(_ranges.largestFree()) / double(freeBytes) : 0.0;
+    }
+
+    unsigned size() const {
+        return _ranges.size();
+    }
+
+private:
+    RangeAllocator _ranges;
+};
+
+
+// The list and multimap best fit allocator BufferAllocator used to have,
+// kept as a baseline
+class BestFitStrategy {
+private:
+    struct Region;
+    typedef std::list<Region> Regions;
+    typedef std::multimap<unsigned, Regions::iterator> RegionIndex;
+
+    struct Region {
+        RegionIndex::iterator it;
+        unsigned start;
+        unsigned end;
+    };
+
+public:
+    typedef Regions::iterator Handle;
+
+    static const char * name() {
+        return "bestfit";
+    }
+
+    explicit BestFitStrategy(unsigned size) :
+        _size(0) {
+        grow(size);
+    }
+
+    Handle allocate(unsigned sz) {
+        RegionIndex::iterator it = _index.lower_bound(sz);
+        while (it == _index.end()) {
+            grow(std::max(_size, sz));
+            it = _index.lower_bound(sz);
+        }
+
+        Regions::iterator thisRegion = it->second;
+        _index.erase(it);
+        thisRegion->it = _index.end();
+        if (thisRegion->end - thisRegion->start != sz) {
+            Regions::iterator nextRegion = thisRegion;
+            ++nextRegion;
+            nextRegion = _regions.insert(nextRegion, Region());
+            nextRegion->end = thisRegion->end;
+            nextRegion->start = thisRegion->start + sz;
+            thisRegion->end = thisRegion->start + sz;
+            nextRegion->it = _index.insert(std::make_pair(nextRegion->end - nextRegion->start, nextRegion));
+        }
+        return thisRegion;
+    }
+
+    void free(Handle region) {
+        if (region != _regions.begin()) {
+            Regions::iterator prev = region;
+            --prev;
+            if (prev->it != _index.end()) {
+                _index.erase(prev->it);
+                region->start = prev->start;
+                _regions.erase(prev);
+            }
+        }
+        Regions::iterator next = region;
+        ++next;
+        if (next != _regions.end() && next->it != _index.end()) {
+            _index.erase(next->it);
+            region->end = next->end;
+            _regions.erase(next);
+        }
+        region->it = _index.insert(std::make_pair(region->end - region->start, region));
+    }
+
+    double fragmentation() const {
+        uint64_t freeBytes = 0;
+        for (const RegionIndex::value_type & entry : _index) {
+            freeBytes += entry.first;
+        }
+        return freeBytes ? 1.0 - double(_index.rbegin()->first) / double(freeBytes) : 0.0;
+    }
+
+    unsigned size() const {
+        return _size;
+    }
+
+private:
+    void grow(unsigned extra) {
+        _regions.emplace_back();
+        Regions::iterator it = --_regions.end();
+        it->start = _size;
+        it->end = _size + extra;
+        it->it = _index.end();
+        _size += extra;
+        free(it);
+    }
+
+    Regions     _regions;
+    RegionIndex _index;
+    unsigned    _size;
+};
+
+
+// A workload is a fixed sequence of operations so every strategy, and both
+// the throughput and latency passes, see exactly the same thing
+struct Op {
+    enum Type {
+        ALLOCATE,
+        FREE,
+    };
+
+    Type     type;
+    unsigned id;
+    unsigned sz;
+};
+
+
+struct Workload {
+    std::string name;
+    std::vector<Op> ops;
+    unsigned slots;
+};
+
+
+enum SizeDist {
+    UNIFORM,
+    POWER_LAW,
+};
+
+
+enum FreeOrder {
+    LIFO,
+    FIFO,
+    RANDOM,
+};
+
+
+Workload makeWorkload(SizeDist dist, FreeOrder order, unsigned live, unsigned churn) {
+    static const char * distNames[] = {"uniform", "powerlaw"};
+    static const char * orderNames[] = {"lifo", "fifo", "random"};
+
+    Workload workload;
+    workload.name = std::string(distNames[dist]) + "/" + orderNames[order];
+    workload.slots = 0;
+
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<unsigned> uniform(16, 64 * 1024);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    auto size = [&]() -> unsigned {
+        if (dist == UNIFORM) {
+            return uniform(rng);
+        }
+        // Pareto with alpha 1.2, lots of small meshes and a few huge ones
+        return unsigned(std::min(64.0 / std::pow(1.0 - unit(rng), 1.0 / 1.2), 4.0 * 1024 * 1024));
+    };
+
+    // Fill up to the live set, then churn against it
+    std::vector<unsigned> alive;
+    for (unsigned i=0; i<live + churn; ++i) {
+        if (i >= live) {
+            unsigned pick;
+            switch (order) {
+            case LIFO:
+                pick = alive.size() - 1;
+                break;
+            case FIFO:
+                pick = 0;
+                break;
+            default:
+                pick = std::uniform_int_distribution<unsigned>(0, alive.size() - 1)(rng);
+                break;
+            }
+            workload.ops.push_back(Op{Op::FREE, alive[pick], 0});
+            if (order == FIFO) {
+                alive.erase(alive.begin());
+            } else {
+                alive[pick] = alive.back();
+                alive.pop_back();
+            }
+        }
+        unsigned id = workload.slots++;
+        workload.ops.push_back(Op{Op::ALLOCATE, id, size()});
+        alive.push_back(id);
+    }
+    return workload;
+}
+
+
+bool loadTrace(const char * path, std::vector<Workload> & workloads) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    // Each allocator in the trace becomes its own workload, frame ends are
+    // only markers and are skipped
+    std::map<std::string, Workload> byName;
+    std::map<std::string, std::unordered_map<uint64_t, unsigned>> ids;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream is(line);
+        std::string name, type;
+        uint64_t id;
+        unsigned sz;
+        if (!(is >> name >> type)) {
+            continue;
+        }
+        Workload & workload = byName[name];
+        workload.name = std::string(path) + ":" + name;
+        if (type == "a" && is >> id >> sz) {
+            unsigned slot = workload.slots++;
+            ids[name][id] = slot;
+            workload.ops.push_back(Op{Op::ALLOCATE, slot, sz});
+        } else if (type == "f" && is >> id) {
+            std::unordered_map<uint64_t, unsigned>::iterator it = ids[name].find(id);
+            if (it != ids[name].end()) {
+                workload.ops.push_back(Op{Op::FREE, it->second, 0});
+                ids[name].erase(it);
+            }
+        }
+    }
+    for (std::pair<const std::string, Workload> & entry : byName) {
+        workloads.push_back(std::move(entry.second));
+    }
+    return true;
+}
+
+
+template<typename Strategy>
+void run(const Workload & workload) {
+    // Throughput pass, no per-op timing to get in the way
+    double seconds;
+    {
+        Strategy strategy(1024 * 1024);
+        std::vector<typename Strategy::Handle> handles(workload.slots);
+        Clock::time_point start = Clock::now();
+        for (const Op & op : workload.ops) {
+            if (op.type == Op::ALLOCATE) {
+                handles[op.id] = strategy.allocate(op.sz);
+            } else {
+                strategy.free(handles[op.id]);
+            }
+        }
+        seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    // Latency pass
+    Strategy strategy(1024 * 1024);
+    std::vector<typename Strategy::Handle> handles(workload.slots);
+    std::vector<uint32_t> latencies;
+    latencies.reserve(workload.ops.size());
+    for (const Op & op : workload.ops) {
+        Clock::time_point start = Clock::now();
+        if (op.type == Op::ALLOCATE) {
+            handles[op.id] = strategy.allocate(op.sz);
+        } else {
+            strategy.free(handles[op.id]);
+        }
+        latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) -> uint32_t {
+        return latencies.empty() ? 0 : latencies[size_t(p * (latencies.size() - 1))];
+    };
+
+    std::cout << std::left << std::setw(32) << workload.name
+              << std::setw(9) << Strategy::name()
+              << std::right << std::fixed << std::setprecision(0)
+              << std::setw(12) << workload.ops.size() / seconds
+              << std::setw(8) << percentile(0.5)
+              << std::setw(8) << percentile(0.99)
+              << std::setprecision(3)
+              << std::setw(8) << strategy.fragmentation()
+              << std::setw(12) << strategy.size()
+              << std::endl;
+}
+
+
+}
+
+
+int main(int argc, char ** argv) {
+    std::vector<Workload> workloads;
+    if (argc > 1) {
+        for (int i=1; i<argc; ++i) {
+            if (!loadTrace(argv[i], workloads)) {
+                std::cerr << "Error: could not read " << argv[i] << std::endl;
+                return 1;
+            }
+        }
+    } else {
+        for (SizeDist dist : {UNIFORM, POWER_LAW}) {
+            for (FreeOrder order : {LIFO, FIFO, RANDOM}) {
+                workloads.push_back(makeWorkload(dist, order, 10000, 200000));
+            }
+        }
+    }
+
+    std::cout << std::left << std::setw(32) << "workload"
+              << std::setw(9) << "strategy"
+              << std::right << std::setw(12) << "ops/s"
+              << std::setw(8) << "p50ns"
+              << std::setw(8) << "p99ns"
+              << std::setw(8) << "frag"
+              << std::setw(12) << "size"
+              << std::endl;
+    for (const Workload & workload : workloads) {
+        run<TlsfStrategy>(workload);
+        run<BestFitStrategy>(workload);
+    }
+    return 0;
+}
+
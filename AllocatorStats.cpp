@@ -0,0 +1,68 @@
+
+#include <cstring>
+#include <ostream>
+
+#include "AllocatorStats.hpp"
+
+
+LatencyHistogram::LatencyHistogram() :
+    _count(0) {
+    memset(_buckets, 0, sizeof(_buckets));
+}
+
+
+uint64_t LatencyHistogram::percentile(double p) const {
+    if (!_count) {
+        return 0;
+    }
+    uint64_t target = uint64_t(p * double(_count - 1)) + 1;
+    uint64_t seen = 0;
+    for (unsigned i=0; i<BUCKETS; ++i) {
+        seen += _buckets[i];
+        if (seen >= target) {
+            return uint64_t(1) << i;
+        }
+    }
+    return uint64_t(1) << (BUCKETS - 1);
+}
+
+
+void AllocatorStats::writeCsvHeader(std::ostream & os) {
+    os << "time,allocator,bytesLive,bytesFree,largestFree,freeRegions,fragmentation,highWater,"
+          "allocations,frees,allocateP50,allocateP99,uploadP50,uploadP99,updateP50,updateP99,freeP50,freeP99\n";
+}
+
+
+void AllocatorStats::writeCsv(std::ostream & os, double time, const char * name) const {
+    os << time << ',' << name << ','
+       << bytesLive << ',' << bytesFree << ',' << largestFree << ',' << freeRegions << ','
+       << fragmentation() << ',' << highWater << ',' << allocations << ',' << frees << ','
+       << allocateCpu.percentile(0.5) << ',' << allocateCpu.percentile(0.99) << ','
+       << allocateUpload.percentile(0.5) << ',' << allocateUpload.percentile(0.99) << ','
+       << updateUpload.percentile(0.5) << ',' << updateUpload.percentile(0.99) << ','
+       << freeCpu.percentile(0.5) << ',' << freeCpu.percentile(0.99) << '\n';
+}
+
+
+void AllocatorStats::writeJson(std::ostream & os, double time, const char * name) const {
+    os << "{\"time\": " << time
+       << ", \"allocator\": \"" << name << '"'
+       << ", \"bytesLive\": " << bytesLive
+       << ", \"bytesFree\": " << bytesFree
+       << ", \"largestFree\": " << largestFree
+       << ", \"freeRegions\": " << freeRegions
+       << ", \"fragmentation\": " << fragmentation()
+       << ", \"highWater\": " << highWater
+       << ", \"allocations\": " << allocations
+       << ", \"frees\": " << frees
+       << ", \"allocateP50\": " << allocateCpu.percentile(0.5)
+       << ", \"allocateP99\": " << allocateCpu.percentile(0.99)
+       << ", \"uploadP50\": " << allocateUpload.percentile(0.5)
+       << ", \"uploadP99\": " << allocateUpload.percentile(0.99)
+       << ", \"updateP50\": " << updateUpload.percentile(0.5)
+       << ", \"updateP99\": " << updateUpload.percentile(0.99)
+       << ", \"freeP50\": " << freeCpu.percentile(0.5)
+       << ", \"freeP99\": " << freeCpu.percentile(0.99)
+       << "}\n";
+}
+
@@ -0,0 +1,83 @@
+#ifndef AllocatorStats_hpp
+#define AllocatorStats_hpp
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+
+
+// Latency histogram with a bucket per power of two nanoseconds, so recording
+// is a couple of instructions and it can be left on all the time
+class LatencyHistogram {
+public:
+    enum {
+        BUCKETS = 40,
+    };
+
+    LatencyHistogram();
+
+    void record(uint64_t ns) {
+        unsigned bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+        ++_buckets[bucket < BUCKETS ? bucket : BUCKETS - 1];
+        ++_count;
+    }
+
+    uint64_t count() const {
+        return _count;
+    }
+
+    // Upper bound of the bucket containing the given fraction of samples
+    uint64_t percentile(double p) const;
+
+private:
+    uint64_t _buckets[BUCKETS];
+    uint64_t _count;
+};
+
+
+// Measures the time between construction and stop()
+class LatencyTimer {
+public:
+    LatencyTimer() :
+        _start(std::chrono::steady_clock::now()) {
+    }
+
+    void stop(LatencyHistogram & histogram) {
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(end - _start).count());
+        _start = end;
+    }
+
+private:
+    std::chrono::steady_clock::time_point _start;
+};
+
+
+struct AllocatorStats {
+    uint64_t bytesLive;     // includes freed regions still waiting on the GPU
+    uint64_t bytesFree;
+    uint64_t largestFree;
+    uint64_t freeRegions;
+    uint64_t highWater;     // most bytes ever live at once
+    uint64_t allocations;
+    uint64_t frees;
+
+    LatencyHistogram allocateCpu;
+    LatencyHistogram allocateUpload;
+    LatencyHistogram updateUpload;  // uploads into existing allocations, such as ConcurrentAllocator's chunks
+    LatencyHistogram freeCpu;
+
+    // Fraction of the free space that cannot be used for one allocation
+    double fragmentation() const {
+        return bytesFree ? 1.0 - double(largestFree) / double(bytesFree) : 0.0;
+    }
+
+    static void writeCsvHeader(std::ostream & os);
+    void writeCsv(std::ostream & os, double time, const char * name) const;
+
+    // One object per line, with the same fields as a CSV row
+    void writeJson(std::ostream & os, double time, const char * name) const;
+};
+
+
+#endif
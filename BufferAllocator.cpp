@@ -1,132 +1,485 @@
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <algorithm>
 #include <cstring>
+#include <ostream>
 #include <stdexcept>
 
 #include "BufferAllocator.hpp"
+#include "GLState.hpp"
+#include "StagingRing.hpp"
 
 
-BufferAllocator::Ref::Ref() {
+BufferAllocator::Ref::Ref() :
+    _page(nullptr),
+    _region(nullptr) {
 }
 
 
-BufferAllocator::Ref::Ref(Regions::iterator it) :
-    _it(it) {
+BufferAllocator::Ref::Ref(Page * page, RangeAllocator::Region * region) :
+    _page(page),
+    _region(region) {
 }
 
 
-BufferAllocator::BufferAllocator() {
-    _buffer = 0;
+BufferAllocator::BufferAllocator() :
+    _stats(),
+    _trace(nullptr),
+    _traceName(nullptr),
+    _traceNext(0),
+    _staging(nullptr),
+    _frame(0),
+    _completed(0),
+    _movedFrame(0),
+    _dirty(false),
+    _mapped(false),
+    _paged(false),
+    _pageSz(0),
+    _target(0),
+    _usage(0) {
 }
 
 
 BufferAllocator::BufferAllocator(BufferAllocator && rhs) :
-    _regions(std::move(rhs._regions)),
-    _index(std::move(rhs._index)),
-    _target(rhs._target),
-    _buffer(rhs._buffer) {
-    rhs._buffer = 0;
+    BufferAllocator() {
+    *this = std::move(rhs);
 }
 
 
 BufferAllocator & BufferAllocator::operator=(BufferAllocator && rhs) {
-    _regions = std::move(rhs._regions);
-    _index = std::move(rhs._index);
-    _target = rhs._target;
-    _buffer = rhs._buffer;
-    rhs._buffer = 0;
+    // Pages are held by pointer so outstanding Refs survive the move
+    std::swap(_pages, rhs._pages);
+    std::swap(_moves, rhs._moves);
+    std::swap(_retired, rhs._retired);
+    std::swap(_fences, rhs._fences);
+    std::swap(_stats, rhs._stats);
+    std::swap(_trace, rhs._trace);
+    std::swap(_traceName, rhs._traceName);
+    std::swap(_traceIds, rhs._traceIds);
+    std::swap(_traceNext, rhs._traceNext);
+    std::swap(_staging, rhs._staging);
+    std::swap(_frame, rhs._frame);
+    std::swap(_completed, rhs._completed);
+    std::swap(_movedFrame, rhs._movedFrame);
+    std::swap(_dirty, rhs._dirty);
+    std::swap(_mapped, rhs._mapped);
+    std::swap(_paged, rhs._paged);
+    std::swap(_pageSz, rhs._pageSz);
+    std::swap(_target, rhs._target);
+    std::swap(_usage, rhs._usage);
     return *this;
 }
 
 
-BufferAllocator::BufferAllocator(unsigned initialSz, unsigned target, unsigned usage) {
-    // Create the buffer
+BufferAllocator::BufferAllocator(unsigned initialSz, unsigned target, unsigned usage, StagingRing * staging, bool paged) :
+    BufferAllocator() {
+    _staging = staging;
+    _paged = paged;
+    _pageSz = initialSz;
     _target = target;
-    glGenBuffers(1, &_buffer);
-    glBindBuffer(target, _buffer);
-    glBufferData(target, initialSz, 0, usage);
-    glBindBuffer(target, 0);
+    _usage = usage;
 
-    // Add the initial range
-    _regions.emplace_front();
-    Regions::iterator it = _regions.begin();
-    it->start = 0;
-    it->end = initialSz;
-    it->it = _index.insert(std::make_pair(initialSz, it));
+    // The first buffer waits for the first allocation, so an allocator that
+    // is never used costs no memory
 }
 
 
 BufferAllocator::~BufferAllocator() {
-    // Release the buffer
-    glDeleteBuffers(1, &_buffer);
+    for (const Fence & fence : _fences) {
+        glDeleteSync((GLsync)fence.fence);
+    }
+
+    // Release the buffers
+    for (const std::unique_ptr<Page> & page : _pages) {
+        GLState::deleteBuffers(1, &page->buffer);
+    }
+}
+
+
+BufferAllocator::Ref BufferAllocator::allocate(void * data, unsigned sz, unsigned align) {
+    // Pick up anything the GPU has finished with
+    LatencyTimer timer;
+    collect();
+
+    // Find a fit, making room if needed
+    Page * page;
+    RangeAllocator::Region * region = reserve(sz, align, page);
+    timer.stop(_stats.allocateCpu);
+
+    // Copy the data into the region
+    upload(page, region->start, data, sz);
+    timer.stop(_stats.allocateUpload);
+
+    ++_stats.allocations;
+    _stats.bytesLive += sz;
+    _stats.highWater = std::max(_stats.highWater, _stats.bytesLive);
+    traceAllocate(region);
+
+    // Return the region for deallocation
+    return Ref(page, region);
+}
+
+
+BufferAllocator::Ref BufferAllocator::allocate(unsigned sz, unsigned align) {
+    LatencyTimer timer;
+    collect();
+    Page * page;
+    RangeAllocator::Region * region = reserve(sz, align, page);
+    timer.stop(_stats.allocateCpu);
+
+    ++_stats.allocations;
+    _stats.bytesLive += sz;
+    _stats.highWater = std::max(_stats.highWater, _stats.bytesLive);
+    traceAllocate(region);
+    return Ref(page, region);
 }
 
 
-BufferAllocator::Ref BufferAllocator::allocate(void * data, unsigned sz) {
-    // Find the best fit
-    RegionIndex::iterator it = _index.lower_bound(sz);
-    if (it == _index.end()) {
-        // No memory available
-        throw std::runtime_error("Out of memory"); // TODO something useful
+void BufferAllocator::update(Ref ref, unsigned offset, const void * data, unsigned sz) {
+    LatencyTimer timer;
+    upload(ref._page, ref._region->start + offset, data, sz);
+    timer.stop(_stats.updateUpload);
+}
+
+
+BufferAllocator::Ref BufferAllocator::split(Ref & ref, unsigned sz) {
+    // The trace sees the old allocation replaced by the two halves
+    traceFree(ref._region);
+    RangeAllocator::Region * tail = ref._page->ranges.split(ref._region, sz);
+    Ref front(ref._page, ref._region);
+    ref._region = tail;
+    ++_stats.allocations;
+    traceAllocate(front._region);
+    traceAllocate(tail);
+    return front;
+}
+
+
+void BufferAllocator::free(Ref ref) {
+    // Draws already submitted may still read this region
+    _retired.push_back(Retired{ref._page, ref._region, _frame});
+    _dirty = true;
+    traceFree(ref._region);
+}
+
+
+std::vector<BufferAllocator::Ref> BufferAllocator::allocateBatch(const Upload * uploads, unsigned count, unsigned align) {
+    std::vector<Ref> refs;
+    if (!count) {
+        return refs;
+    }
+    uint64_t total = 0;
+    for (unsigned i=0; i<count; ++i) {
+        if (!uploads[i].sz || uploads[i].sz % align) {
+            throw std::runtime_error("Batch allocation sizes must be nonzero multiples of the alignment");
+        }
+        total += uploads[i].sz;
+    }
+    if (total > 0xffffffffu) {
+        throw std::runtime_error("Out of memory");
+    }
+    refs.reserve(count);
+    LatencyTimer timer;
+    collect();
+
+    // Reserve the whole batch as one region, making room for all of it at
+    // once if needed
+    Page * page;
+    RangeAllocator::Region * region = find(unsigned(total), align, page);
+    if (!region && (!_paged || total <= _pageSz)) {
+        region = reserve(unsigned(total), align, page);
+    }
+    if (!region) {
+        // Bigger than a page, so place them one by one
+        for (unsigned i=0; i<count; ++i) {
+            refs.push_back(allocate(const_cast<void*>(uploads[i].data), uploads[i].sz, align));
+        }
+        return refs;
     }
 
-    // Remove this region from the index
-    Regions::iterator thisRegion = it->second;
-    _index.erase(it);
-    thisRegion->it = _index.end();
+    // Carve it up and fill it with a single upload
+    timer.stop(_stats.allocateCpu);
+    char * buf = beginUpload(page, region->start, unsigned(total));
+    for (unsigned i=0; i<count; ++i) {
+        RangeAllocator::Region * tail = i + 1 < count ? page->ranges.split(region, uploads[i].sz) : nullptr;
+        memcpy(buf, uploads[i].data, uploads[i].sz);
+        buf += uploads[i].sz;
+        refs.push_back(Ref(page, region));
+        traceAllocate(region);
+        region = tail;
+    }
+    endUpload();
+    timer.stop(_stats.allocateUpload);
 
-    // If there is a tail then split the region
-    if (thisRegion->end - thisRegion->start != sz) {
-        Regions::iterator nextRegion = thisRegion;
-        ++nextRegion;
-        nextRegion = _regions.insert(nextRegion, Region());
+    _stats.allocations += count;
+    _stats.bytesLive += total;
+    _stats.highWater = std::max(_stats.highWater, _stats.bytesLive);
+    return refs;
+}
 
-        nextRegion->end = thisRegion->end;
-        nextRegion->start = thisRegion->start + sz;
-        thisRegion->end = thisRegion->start + sz;
-        _index.insert(std::make_pair(nextRegion->end - nextRegion->start, nextRegion));
+
+void BufferAllocator::freeBatch(const std::vector<Ref> & refs) {
+    for (const Ref & ref : refs) {
+        _retired.push_back(Retired{ref._page, ref._region, _frame});
+        traceFree(ref._region);
     }
+    _dirty = _dirty || !refs.empty();
+}
 
-    // Copy the data into the region
-    glBindBuffer(_target, _buffer);
-    void * buf = glMapBufferRange(_target, thisRegion->start, sz, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
-    memcpy(buf, data, sz);
-    glUnmapBuffer(_target);
-    glBindBuffer(_target, 0);
 
-    // Return the iterator for deallocation
-    return Ref(thisRegion);
+void BufferAllocator::endFrame() {
+    if (_dirty) {
+        _fences.push_back(Fence{glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0), _frame});
+        _dirty = false;
+    }
+    ++_frame;
+    collect();
+
+    if (_trace) {
+        *_trace << _traceName << " e\n";
+    }
 }
 
 
-void BufferAllocator::free(Ref ref) {
-    // Merge with a free section before
-    if (ref._it != _regions.begin()) {
-        Regions::iterator prev = ref._it;
-        --prev;
-
-        if (prev->it != _index.end()) {
-            _index.erase(prev->it);
-            ref._it->start = prev->start;
-            _regions.erase(prev);
+bool BufferAllocator::defragment(unsigned budget) {
+    // Queued uploads target the current offsets, so land them first
+    if (_staging) {
+        _staging->flush();
+    }
+
+    bool more = false;
+    unsigned scratch = 0;
+    unsigned scratchSz = 0;
+    for (const std::unique_ptr<Page> & page : _pages) {
+        // Let the bookkeeping decide what goes where, then move the data
+        _moves.clear();
+        more = page->ranges.compact(budget, _moves) || more;
+
+        // Overlapping copies within one buffer are not allowed, so those
+        // bounce through a scratch buffer
+        for (const RangeAllocator::Move & move : _moves) {
+            budget -= std::min(budget, move.sz);
+            if (move.dst + move.sz <= move.src) {
+                copy(page->buffer, move.src, move.dst, move.sz);
+                continue;
+            }
+            if (move.sz > scratchSz) {
+                if (!scratch) {
+                    glGenBuffers(1, &scratch);
+                }
+                scratchSz = move.sz;
+                GLState::bindBuffer(GL_COPY_WRITE_BUFFER, scratch);
+                glBufferData(GL_COPY_WRITE_BUFFER, scratchSz, 0, GL_STREAM_COPY);
+            }
+            GLState::bindBuffer(GL_COPY_READ_BUFFER, page->buffer);
+            GLState::bindBuffer(GL_COPY_WRITE_BUFFER, scratch);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, move.src, 0, move.sz);
+            GLState::bindBuffer(GL_COPY_READ_BUFFER, scratch);
+            GLState::bindBuffer(GL_COPY_WRITE_BUFFER, page->buffer);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, move.dst, move.sz);
+        }
+        if (!_moves.empty()) {
+            // The vacated ranges are free but may still be read by earlier draws
+            _movedFrame = _frame + 1;
+            _dirty = true;
+        }
+        if (!budget) {
+            more = true;
+            break;
+        }
+    }
+    if (scratch) {
+        GLState::deleteBuffers(1, &scratch);
+    }
+    return more;
+}
+
+
+AllocatorStats BufferAllocator::stats() const {
+    // Counters are kept as we go, the free space is read from the pages
+    AllocatorStats stats = _stats;
+    for (const std::unique_ptr<Page> & page : _pages) {
+        stats.bytesFree += page->ranges.freeBytes();
+        stats.freeRegions += page->ranges.freeRegions();
+        stats.largestFree = std::max<uint64_t>(stats.largestFree, page->ranges.largestFree());
+    }
+    return stats;
+}
+
+
+void BufferAllocator::setTrace(std::ostream * os, const char * name) {
+    _trace = os;
+    _traceName = name;
+    _traceIds.clear();
+}
+
+
+RangeAllocator::Region * BufferAllocator::find(unsigned sz, unsigned align, Page *& page) {
+    // Newer pages are the least likely to be full
+    for (unsigned i=_pages.size(); i>0; --i) {
+        page = _pages[i - 1].get();
+        if (RangeAllocator::Region * region = page->ranges.allocate(sz, align)) {
+            return region;
         }
     }
+    return nullptr;
+}
 
-    // Merge with a free section after
-    if (ref._it != _regions.end()) {
-        Regions::iterator next = ref._it;
-        ++next;
 
-        if (next != _regions.end() && next->it != _index.end()) {
-            _index.erase(next->it);
-            ref._it->end = next->end;
-            _regions.erase(next);
+RangeAllocator::Region * BufferAllocator::reserve(unsigned sz, unsigned align, Page *& page) {
+    RangeAllocator::Region * region = find(sz, align, page);
+    if (region) {
+        return region;
+    }
+
+    // No memory available, so make some
+    if (_paged) {
+        if (sz > _pageSz) {
+            throw std::runtime_error("Allocation larger than a page");
         }
+        page = addPage(_pageSz);
+    } else if (_pages.empty()) {
+        // A new buffer starts at 0, which suits any alignment
+        page = addPage(std::max(_pageSz, sz));
+    } else {
+        // The new space may start anywhere, so leave room to align it
+        page = _pages[0].get();
+        grow(page, sz + align - 1);
+    }
+    return page->ranges.allocate(sz, align);
+}
+
+
+BufferAllocator::Page * BufferAllocator::addPage(unsigned sz) {
+    std::unique_ptr<Page> page(new Page{RangeAllocator(sz), unsigned(_pages.size()), 0});
+    glGenBuffers(1, &page->buffer);
+    GLState::bindBuffer(GL_COPY_WRITE_BUFFER, page->buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, sz, 0, _usage);
+    _pages.push_back(std::move(page));
+    return _pages.back().get();
+}
+
+
+void BufferAllocator::grow(Page * page, unsigned minSz) {
+    // Grow geometrically so repeated allocations stay amortised constant time
+    unsigned oldSz = page->ranges.size();
+    uint64_t newSz = std::max<uint64_t>(uint64_t(oldSz) * 2, 1024);
+    while (newSz < uint64_t(oldSz) + minSz) {
+        newSz *= 2;
+    }
+    if (newSz > 0xffffffffu) {
+        throw std::runtime_error("Out of memory");
     }
 
-    // Insert into index
-    ref._it->it = _index.insert(std::make_pair(ref._it->end - ref._it->start, ref._it));
+    // Reallocate in place so the buffer name, and anything that refers to
+    // it such as a VAO, stays valid. The old contents bounce through a
+    // temporary buffer on the GPU.
+    unsigned tmp;
+    glGenBuffers(1, &tmp);
+    GLState::bindBuffer(GL_COPY_WRITE_BUFFER, tmp);
+    glBufferData(GL_COPY_WRITE_BUFFER, oldSz, 0, GL_STREAM_COPY);
+    GLState::bindBuffer(GL_COPY_READ_BUFFER, page->buffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldSz);
+
+    glBufferData(GL_COPY_READ_BUFFER, newSz, 0, _usage);
+    GLState::bindBuffer(GL_COPY_READ_BUFFER, tmp);
+    GLState::bindBuffer(GL_COPY_WRITE_BUFFER, page->buffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldSz);
+    GLState::deleteBuffers(1, &tmp);
+
+    page->ranges.grow(unsigned(newSz));
+}
+
+
+void BufferAllocator::copy(unsigned buffer, unsigned src, unsigned dst, unsigned sz) {
+    GLState::bindBuffer(GL_COPY_READ_BUFFER, buffer);
+    GLState::bindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, src, dst, sz);
+}
+
+
+void BufferAllocator::upload(Page * page, unsigned offset, const void * data, unsigned sz) {
+    memcpy(beginUpload(page, offset, sz), data, sz);
+    endUpload();
+}
+
+
+char * BufferAllocator::beginUpload(Page * page, unsigned offset, unsigned sz) {
+    // Prefer batching through the staging ring
+    if (_staging) {
+        if (void * buf = _staging->reserve(page->buffer, offset, sz)) {
+            return (char*)buf;
+        }
+    }
+
+    // Fall back to mapping the region directly. Retired regions are only
+    // reused once their fence has signalled so this needs no sync, unless
+    // compaction has just vacated space that earlier draws still read.
+    GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT;
+    if (_completed >= _movedFrame) {
+        access |= GL_MAP_UNSYNCHRONIZED_BIT;
+    }
+    GLState::bindBuffer(GL_COPY_WRITE_BUFFER, page->buffer);
+    _mapped = true;
+    return (char*)glMapBufferRange(GL_COPY_WRITE_BUFFER, offset, sz, access);
+}
+
+
+void BufferAllocator::endUpload() {
+    if (_mapped) {
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+        _mapped = false;
+    }
+}
+
+
+void BufferAllocator::collect() {
+    // Find the newest frame the GPU has finished
+    while (!_fences.empty()) {
+        GLsync fence = (GLsync)_fences.front().fence;
+        GLenum status = glClientWaitSync(fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+            break;
+        }
+        glDeleteSync(fence);
+        _completed = _fences.front().frame + 1;
+        _fences.pop_front();
+    }
+
+    // Merge everything freed in those frames back into the free index
+    while (!_retired.empty() && _retired.front().frame < _completed) {
+        const Retired & retired = _retired.front();
+        _stats.bytesLive -= retired.region->end - retired.region->start;
+        ++_stats.frees;
+
+        LatencyTimer timer;
+        retired.page->ranges.free(retired.region);
+        timer.stop(_stats.freeCpu);
+        _retired.pop_front();
+    }
+}
+
+
+void BufferAllocator::traceAllocate(RangeAllocator::Region * region) {
+    // Region nodes are recycled, so the trace gets ids of its own, each
+    // used once per trace
+    if (_trace) {
+        uint64_t id = _traceNext++;
+        _traceIds[region] = id;
+        *_trace << _traceName << " a " << id << ' ' << region->end - region->start << '\n';
+    }
+}
+
+
+void BufferAllocator::traceFree(RangeAllocator::Region * region) {
+    if (_trace) {
+        std::unordered_map<const void*, uint64_t>::iterator it = _traceIds.find(region);
+        if (it != _traceIds.end()) {
+            *_trace << _traceName << " f " << it->second << '\n';
+            _traceIds.erase(it);
+        }
+    }
 }
 
 
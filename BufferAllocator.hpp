@@ -1,15 +1,25 @@
 #ifndef BufferAllocator_hpp
 #define BufferAllocator_hpp
 
-#include <list>
-#include <map>
+#include <deque>
+#include <iosfwd>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "AllocatorStats.hpp"
+#include "RangeAllocator.hpp"
+
+class StagingRing;
 
 
 class BufferAllocator {
 private:
-    struct Region;
-    typedef std::list<Region> Regions;
-    typedef std::multimap<unsigned, Regions::iterator> RegionIndex;
+    struct Page {
+        RangeAllocator ranges;
+        unsigned index;
+        unsigned buffer;
+    };
 
 public:
     class Ref {
@@ -17,40 +27,140 @@ public:
         Ref();
 
         unsigned operator*() const {
-            return _it->start;
+            return _region->start;
+        }
+
+        unsigned size() const {
+            return _region->end - _region->start;
+        }
+
+        unsigned buffer() const {
+            return _page->buffer;
+        }
+
+        unsigned page() const {
+            return _page->index;
         }
 
     private:
-        Ref(Regions::iterator it);
+        Ref(Page * page, RangeAllocator::Region * region);
 
-        Regions::iterator _it;
+        Page * _page;
+        RangeAllocator::Region * _region;
         friend class BufferAllocator;
     };
 
+    struct Upload {
+        const void * data;
+        unsigned     sz;
+    };
+
     BufferAllocator();
     BufferAllocator(BufferAllocator && rhs);
     BufferAllocator & operator=(BufferAllocator && rhs);
-    BufferAllocator(unsigned initialSz, unsigned target, unsigned usage);
+
+    // A single buffer grows to fit. A paged allocator instead adds buffers
+    // of initialSz each, and no allocation may straddle two of them. Either
+    // way there are no buffers until the first allocation.
+    BufferAllocator(unsigned initialSz, unsigned target, unsigned usage, StagingRing * staging = nullptr, bool paged = false);
     ~BufferAllocator();
 
-    Ref allocate(void * data, unsigned sz);
+    // The offset of the allocation is a multiple of align, so it can be
+    // addressed in whole elements of that size
+    Ref allocate(void * data, unsigned sz, unsigned align = 1);
+
+    // Reserves space without uploading anything, fill it in with update()
+    Ref allocate(unsigned sz, unsigned align = 1);
+
+    // Uploads into part of an existing allocation. The GPU must not be
+    // reading that part, e.g. because it has never been drawn from.
+    void update(Ref ref, unsigned offset, const void * data, unsigned sz);
+
+    // Splits the first sz bytes off an allocation into one of their own,
+    // which is returned, and leaves ref with the rest. sz must be a multiple
+    // of the alignment the allocation was made with and less than its size.
+    Ref split(Ref & ref, unsigned sz);
+
+    // The region is only reused once the GPU has finished the frame it was
+    // freed in, see endFrame()
     void free(Ref ref);
 
+    // Allocates and uploads many blocks at once. They are placed back to
+    // back when possible so the upload is a single copy. Sizes must be
+    // nonzero multiples of align.
+    std::vector<Ref> allocateBatch(const Upload * uploads, unsigned count, unsigned align = 1);
+    void freeBatch(const std::vector<Ref> & refs);
+
+    // Fences everything freed or moved since the last call, should be called
+    // once per frame after the draws have been submitted
+    void endFrame();
+
+    // Moves up to about budget bytes of live data down into holes, Refs are
+    // patched in place. Returns false once every page is fully packed.
+    bool defragment(unsigned budget);
+
+    AllocatorStats stats() const;
+
+    // Records every allocate, free and frame end to os as text lines
+    // prefixed with name, for replaying in AllocatorBench. Pass nullptr to
+    // stop recording.
+    void setTrace(std::ostream * os, const char * name);
+
+    unsigned pageCount() const {
+        return _pages.size();
+    }
+
+    unsigned buffer(unsigned page) const {
+        return _pages[page]->buffer;
+    }
+
     unsigned operator*() const {
-        return _buffer;
+        return _pages.empty() ? 0 : _pages[0]->buffer;
     }
 
 private:
-    struct Region {
-        RegionIndex::iterator it;
-        unsigned start;
-        unsigned end;
+    RangeAllocator::Region * find(unsigned sz, unsigned align, Page *& page);
+    RangeAllocator::Region * reserve(unsigned sz, unsigned align, Page *& page);
+    Page * addPage(unsigned sz);
+    void grow(Page * page, unsigned minSz);
+    void copy(unsigned buffer, unsigned src, unsigned dst, unsigned sz);
+    void upload(Page * page, unsigned offset, const void * data, unsigned sz);
+    char * beginUpload(Page * page, unsigned offset, unsigned sz);
+    void endUpload();
+    void collect();
+    void traceAllocate(RangeAllocator::Region * region);
+    void traceFree(RangeAllocator::Region * region);
+
+    struct Retired {
+        Page *   page;
+        RangeAllocator::Region * region;
+        unsigned frame;
     };
-    
-    Regions         _regions;
-    RegionIndex     _index; // by size
-    unsigned        _target;
-    unsigned        _buffer;
+
+    struct Fence {
+        void *   fence;
+        unsigned frame;
+    };
+
+    std::vector<std::unique_ptr<Page>> _pages;
+    std::vector<RangeAllocator::Move> _moves;
+    std::deque<Retired> _retired;   // freed but possibly still being drawn
+    std::deque<Fence>   _fences;
+    AllocatorStats  _stats;
+    std::ostream *  _trace;
+    const char *    _traceName;
+    std::unordered_map<const void*, uint64_t> _traceIds;
+    uint64_t        _traceNext;
+    StagingRing *   _staging;
+    unsigned        _frame;
+    unsigned        _completed; // frames before this are finished on the GPU
+    unsigned        _movedFrame; // direct uploads must sync until this completes
+    bool            _dirty;
+    bool            _mapped;
+    bool            _paged;
+    unsigned        _pageSz;
+    unsigned        _target;    // what the buffers are drawn as, never bound here as it may be VAO state
+    unsigned        _usage;
 };
 
 
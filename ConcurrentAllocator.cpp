@@ -0,0 +1,160 @@
+
+#include <stdexcept>
+#include <utility>
+
+#include "ConcurrentAllocator.hpp"
+
+
+ConcurrentAllocator::Arena::Arena(ConcurrentAllocator & allocator) :
+    _allocator(allocator),
+    _left(0) {
+}
+
+
+ConcurrentAllocator::Arena::~Arena() {
+    commit();
+}
+
+
+void ConcurrentAllocator::Arena::allocate(const void * data, unsigned sz, BufferAllocator::Ref * ref) {
+    if (!sz || sz % _allocator._align || sz > _allocator._chunkSz) {
+        throw std::runtime_error("Concurrent allocations must be nonzero multiples of the alignment that fit in a chunk");
+    }
+
+    // Hand the full chunk over so it can be landed, and start another
+    if (sz > _left) {
+        commit();
+        _chunk = _allocator.takeChunk();
+        _left = _allocator._chunkSz;
+    }
+    _left -= sz;
+
+    const char * bytes = (const char*)data;
+    unsigned src = _batch.data.size();
+    _batch.data.insert(_batch.data.end(), bytes, bytes + sz);
+    _batch.staged.push_back(Staged{_chunk.get(), src, sz, ref});
+}
+
+
+void ConcurrentAllocator::Arena::commit() {
+    if (_chunk) {
+        _batch.done.push_back(std::move(_chunk));
+    }
+    if (_batch.done.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(_allocator._lock);
+    _allocator._batches.push_back(std::move(_batch));
+    _batch = Batch();
+}
+
+
+ConcurrentAllocator::ConcurrentAllocator(BufferAllocator & allocator, unsigned chunkSz, unsigned align) :
+    _allocator(allocator),
+    _chunkSz(chunkSz),
+    _align(align),
+    _renderThread(std::this_thread::get_id()),
+    _waiting(0),
+    _started(false) {
+    if (!align || !chunkSz || chunkSz % align) {
+        throw std::runtime_error("Chunk size must be a nonzero multiple of the alignment");
+    }
+}
+
+
+ConcurrentAllocator::~ConcurrentAllocator() {
+    // The Refs are already out there, so what is staged must still land
+    for (Batch & batch : _batches) {
+        land(batch);
+    }
+    for (std::unique_ptr<Chunk> & chunk : _spare) {
+        release(std::move(chunk));
+    }
+}
+
+
+void ConcurrentAllocator::flush() {
+    std::vector<Batch> batches;
+    unsigned wanted;
+    unsigned spare;
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        batches.swap(_batches);
+        wanted = _waiting + (_started ? SPARE_CHUNKS : 0);
+        spare = _spare.size();
+    }
+    for (Batch & batch : batches) {
+        land(batch);
+    }
+
+    // Reserving space may grow the buffer, so do it outside the lock
+    std::vector<std::unique_ptr<Chunk>> fresh;
+    while (spare + fresh.size() < wanted) {
+        fresh.push_back(newChunk());
+    }
+    if (!fresh.empty()) {
+        std::lock_guard<std::mutex> lock(_lock);
+        for (std::unique_ptr<Chunk> & chunk : fresh) {
+            _spare.push_back(std::move(chunk));
+        }
+        _refilled.notify_all();
+    }
+}
+
+
+std::unique_ptr<ConcurrentAllocator::Chunk> ConcurrentAllocator::takeChunk() {
+    std::unique_lock<std::mutex> lock(_lock);
+    _started = true;
+    if (_spare.empty() && std::this_thread::get_id() == _renderThread) {
+        // Nobody else would make one
+        lock.unlock();
+        return newChunk();
+    }
+    ++_waiting;
+    _refilled.wait(lock, [this] { return !_spare.empty(); });
+    --_waiting;
+    std::unique_ptr<Chunk> chunk = std::move(_spare.back());
+    _spare.pop_back();
+    return chunk;
+}
+
+
+std::unique_ptr<ConcurrentAllocator::Chunk> ConcurrentAllocator::newChunk() {
+    return std::unique_ptr<Chunk>(new Chunk{_allocator.allocate(_chunkSz, _align), false});
+}
+
+
+void ConcurrentAllocator::land(Batch & batch) {
+    // Runs of allocations in one chunk are back to back both there and in
+    // the staging memory, so each run goes up in a single copy
+    const std::vector<Staged> & staged = batch.staged;
+    for (unsigned i=0; i<staged.size();) {
+        Chunk * chunk = staged[i].chunk;
+        unsigned end = i;
+        unsigned sz = 0;
+        while (end < staged.size() && staged[end].chunk == chunk) {
+            sz += staged[end++].sz;
+        }
+        _allocator.update(chunk->ref, 0, &batch.data[staged[i].src], sz);
+
+        // Then split the run off the front of the chunk
+        for (; i<end; ++i) {
+            if (staged[i].sz < chunk->ref.size()) {
+                *staged[i].ref = _allocator.split(chunk->ref, staged[i].sz);
+            } else {
+                *staged[i].ref = chunk->ref;
+                chunk->spent = true;
+            }
+        }
+    }
+    for (std::unique_ptr<Chunk> & chunk : batch.done) {
+        release(std::move(chunk));
+    }
+}
+
+
+void ConcurrentAllocator::release(std::unique_ptr<Chunk> chunk) {
+    if (!chunk->spent) {
+        _allocator.free(chunk->ref);
+    }
+}
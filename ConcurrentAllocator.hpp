@@ -0,0 +1,107 @@
+#ifndef ConcurrentAllocator_hpp
+#define ConcurrentAllocator_hpp
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "BufferAllocator.hpp"
+
+
+// Lets worker threads allocate from a BufferAllocator without touching GL.
+// Each worker writes through an Arena of its own, which hands out space in
+// chunks of the buffer reserved by the render thread and copies the data
+// into CPU memory. The render thread uploads it in bulk in flush(), and
+// splits the chunks up into ordinary BufferAllocator allocations.
+//
+// Only Arena may be used off the render thread. Allocations have no Ref
+// until the flush() that uploads them, after which the worker is out of the
+// picture, so Refs are never read while defragment() moves things.
+class ConcurrentAllocator {
+private:
+    struct Chunk {
+        BufferAllocator::Ref ref;   // the part not yet split off
+        bool     spent;             // nothing is left
+    };
+
+    struct Staged {
+        Chunk *  chunk;
+        unsigned src;       // in Batch::data
+        unsigned sz;
+        BufferAllocator::Ref * ref;
+    };
+
+    // Handed from an arena to flush() in one go
+    struct Batch {
+        std::vector<char>   data;
+        std::vector<Staged> staged;
+        std::vector<std::unique_ptr<Chunk>> done;   // the arena has finished with these
+    };
+
+public:
+    // One per worker thread, destroyed before the allocator
+    class Arena {
+    public:
+        explicit Arena(ConcurrentAllocator & allocator);
+        ~Arena();
+
+        Arena(const Arena &) = delete;
+        Arena & operator=(const Arena &) = delete;
+
+        // Copies the data and returns. *ref is filled in by the flush() that
+        // uploads it, which is after this arena is destroyed or has moved on
+        // to another chunk, so it must stay put until then. sz must be a
+        // nonzero multiple of the alignment and fit in a chunk. Blocks while
+        // there is no chunk to hand until flush() reserves one.
+        void allocate(const void * data, unsigned sz, BufferAllocator::Ref * ref);
+
+    private:
+        void commit();
+
+        ConcurrentAllocator &  _allocator;
+        std::unique_ptr<Chunk> _chunk;
+        unsigned               _left;   // bytes of _chunk not handed out
+        Batch                  _batch;
+    };
+
+    // On the render thread. Every allocation is aligned to align, and
+    // chunkSz must be a multiple of it that fits in a page.
+    ConcurrentAllocator(BufferAllocator & allocator, unsigned chunkSz, unsigned align);
+
+    // Lands everything staged, so the arenas must be gone
+    ~ConcurrentAllocator();
+
+    ConcurrentAllocator(const ConcurrentAllocator &) = delete;
+    ConcurrentAllocator & operator=(const ConcurrentAllocator &) = delete;
+
+    // Uploads whatever the arenas have handed over, fills in its Refs and
+    // reserves chunks for waiting workers. They are blocked without it, so
+    // keep calling it while they run.
+    void flush();
+
+private:
+    enum {
+        SPARE_CHUNKS = 4,
+    };
+
+    std::unique_ptr<Chunk> takeChunk();
+    std::unique_ptr<Chunk> newChunk();
+    void land(Batch & batch);
+    void release(std::unique_ptr<Chunk> chunk);
+
+    BufferAllocator &       _allocator;
+    unsigned                _chunkSz;
+    unsigned                _align;
+    std::thread::id         _renderThread;
+    std::mutex              _lock;  // guards everything below
+    std::condition_variable _refilled;
+    std::vector<std::unique_ptr<Chunk>> _spare;
+    std::vector<Batch>      _batches;
+    unsigned                _waiting;   // workers blocked on a chunk
+    bool                    _started;   // spares are only kept once used
+};
+
+
+#endif
@@ -0,0 +1,100 @@
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "Framebuffer.hpp"
+
+
+Framebuffer::Framebuffer() :
+    _framebuffer(0),
+    _color(0),
+    _depth(0),
+    _width(0),
+    _height(0) {
+}
+
+
+Framebuffer::Framebuffer(Framebuffer && rhs) :
+    Framebuffer() {
+    *this = std::move(rhs);
+}
+
+
+Framebuffer & Framebuffer::operator=(Framebuffer && rhs) {
+    std::swap(_framebuffer, rhs._framebuffer);
+    std::swap(_color, rhs._color);
+    std::swap(_depth, rhs._depth);
+    std::swap(_width, rhs._width);
+    std::swap(_height, rhs._height);
+    return *this;
+}
+
+
+Framebuffer::Framebuffer(int width, int height) :
+    Framebuffer() {
+    _width = width;
+    _height = height;
+
+    // sRGB to match the window's default framebuffer
+    glGenRenderbuffers(1, &_color);
+    glBindRenderbuffer(GL_RENDERBUFFER, _color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_SRGB8_ALPHA8, width, height);
+    glGenRenderbuffers(1, &_depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, _depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &_framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, _color);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, _depth);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        throw std::runtime_error("Framebuffer incomplete");
+    }
+}
+
+
+Framebuffer::~Framebuffer() {
+    if (_framebuffer) {
+        glDeleteFramebuffers(1, &_framebuffer);
+        glDeleteRenderbuffers(1, &_color);
+        glDeleteRenderbuffers(1, &_depth);
+    }
+}
+
+
+void Framebuffer::bind() {
+    glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+}
+
+
+void Framebuffer::unbind() {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+
+void Framebuffer::writePpm(const std::string & path) {
+    std::vector<unsigned char> pixels(_width * _height * 3);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, _framebuffer);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, _width, _height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Could not write " + path);
+    }
+
+    // GL rows run bottom to top, PPM rows top to bottom
+    file << "P6\n" << _width << " " << _height << "\n255\n";
+    for (int y=_height - 1; y>=0; --y) {
+        file.write((const char*)&pixels[y * _width * 3], _width * 3);
+    }
+}
+
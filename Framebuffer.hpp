@@ -0,0 +1,36 @@
+#ifndef Framebuffer_hpp
+#define Framebuffer_hpp
+
+#include <string>
+
+
+// An offscreen sRGB colour and depth target, for rendering without a window
+class Framebuffer {
+public:
+    Framebuffer();
+    Framebuffer(Framebuffer && rhs);
+    Framebuffer & operator=(Framebuffer && rhs);
+    Framebuffer(int width, int height);
+    ~Framebuffer();
+
+    // Draws go here until unbind()
+    void bind();
+    void unbind();
+
+    // Reads back the colour buffer and writes it as a binary PPM
+    void writePpm(const std::string & path);
+
+    unsigned operator*() const {
+        return _framebuffer;
+    }
+
+private:
+    unsigned _framebuffer;
+    unsigned _color;
+    unsigned _depth;
+    int      _width;
+    int      _height;
+};
+
+
+#endif
@@ -0,0 +1,243 @@
+
+#include <cmath>
+#include <immintrin.h>
+
+#include "Frustum.hpp"
+
+
+namespace {
+
+
+typedef float Planes[4][6];
+
+
+// For spheres ex holds the radius and ey, ez are unused
+template<bool BOXES>
+bool visibleScalar(const Planes & planes, float x, float y, float z, float ex, float ey, float ez) {
+    for (int p=0; p<6; ++p) {
+        float d = planes[0][p]*x + planes[1][p]*y + planes[2][p]*z + planes[3][p];
+        float r = BOXES ? fabsf(planes[0][p])*ex + fabsf(planes[1][p])*ey + fabsf(planes[2][p])*ez : ex;
+        if (!(d + r >= 0.0f)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+template<bool BOXES>
+unsigned cullScalar(const Planes & planes, const float * x, const float * y, const float * z,
+                    const float * ex, const float * ey, const float * ez, unsigned i, unsigned n, unsigned * visible) {
+    unsigned count = 0;
+    for (; i<n; ++i) {
+        if (visibleScalar<BOXES>(planes, x[i], y[i], z[i], ex[i], BOXES ? ey[i] : 0.0f, BOXES ? ez[i] : 0.0f)) {
+            visible[count++] = i;
+        }
+    }
+    return count;
+}
+
+
+// Four volumes per register against each plane in turn, then the lanes
+// still inside are appended to the list
+template<bool BOXES>
+unsigned cullSse(const Planes & planes, const float * x, const float * y, const float * z,
+                 const float * ex, const float * ey, const float * ez, unsigned n, unsigned * visible) {
+    __m128 a[6], b[6], c[6], d[6], absA[6], absB[6], absC[6];
+    for (int p=0; p<6; ++p) {
+        a[p] = _mm_set1_ps(planes[0][p]);
+        b[p] = _mm_set1_ps(planes[1][p]);
+        c[p] = _mm_set1_ps(planes[2][p]);
+        d[p] = _mm_set1_ps(planes[3][p]);
+        absA[p] = _mm_set1_ps(fabsf(planes[0][p]));
+        absB[p] = _mm_set1_ps(fabsf(planes[1][p]));
+        absC[p] = _mm_set1_ps(fabsf(planes[2][p]));
+    }
+
+    unsigned count = 0;
+    unsigned i = 0;
+    __m128 zero = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4) {
+        __m128 vx = _mm_loadu_ps(&x[i]);
+        __m128 vy = _mm_loadu_ps(&y[i]);
+        __m128 vz = _mm_loadu_ps(&z[i]);
+        __m128 vex = _mm_loadu_ps(&ex[i]);
+        __m128 vey = BOXES ? _mm_loadu_ps(&ey[i]) : zero;
+        __m128 vez = BOXES ? _mm_loadu_ps(&ez[i]) : zero;
+
+        __m128 inside = _mm_cmpeq_ps(zero, zero);
+        for (int p=0; p<6; ++p) {
+            __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[p], vx), _mm_mul_ps(b[p], vy)),
+                                     _mm_add_ps(_mm_mul_ps(c[p], vz), d[p]));
+            __m128 r = BOXES ? _mm_add_ps(_mm_add_ps(_mm_mul_ps(absA[p], vex), _mm_mul_ps(absB[p], vey)), _mm_mul_ps(absC[p], vez)) : vex;
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(dist, r), zero));
+        }
+
+        unsigned mask = _mm_movemask_ps(inside);
+        while (mask) {
+            visible[count++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return count + cullScalar<BOXES>(planes, x, y, z, ex, ey, ez, i, n, visible + count);
+}
+
+
+template<bool BOXES>
+__attribute__((target("avx2,fma")))
+unsigned cullAvx2(const Planes & planes, const float * x, const float * y, const float * z,
+                  const float * ex, const float * ey, const float * ez, unsigned n, unsigned * visible) {
+    __m256 a[6], b[6], c[6], d[6], absA[6], absB[6], absC[6];
+    for (int p=0; p<6; ++p) {
+        a[p] = _mm256_set1_ps(planes[0][p]);
+        b[p] = _mm256_set1_ps(planes[1][p]);
+        c[p] = _mm256_set1_ps(planes[2][p]);
+        d[p] = _mm256_set1_ps(planes[3][p]);
+        absA[p] = _mm256_set1_ps(fabsf(planes[0][p]));
+        absB[p] = _mm256_set1_ps(fabsf(planes[1][p]));
+        absC[p] = _mm256_set1_ps(fabsf(planes[2][p]));
+    }
+
+    unsigned count = 0;
+    unsigned i = 0;
+    __m256 zero = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        __m256 vx = _mm256_loadu_ps(&x[i]);
+        __m256 vy = _mm256_loadu_ps(&y[i]);
+        __m256 vz = _mm256_loadu_ps(&z[i]);
+        __m256 vex = _mm256_loadu_ps(&ex[i]);
+        __m256 vey = BOXES ? _mm256_loadu_ps(&ey[i]) : zero;
+        __m256 vez = BOXES ? _mm256_loadu_ps(&ez[i]) : zero;
+
+        __m256 inside = _mm256_cmp_ps(zero, zero, _CMP_EQ_OQ);
+        for (int p=0; p<6; ++p) {
+            __m256 dist = _mm256_fmadd_ps(a[p], vx, _mm256_fmadd_ps(b[p], vy, _mm256_fmadd_ps(c[p], vz, d[p])));
+            if (BOXES) {
+                dist = _mm256_fmadd_ps(absA[p], vex, _mm256_fmadd_ps(absB[p], vey, _mm256_fmadd_ps(absC[p], vez, dist)));
+            } else {
+                dist = _mm256_add_ps(dist, vex);
+            }
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(dist, zero, _CMP_GE_OQ));
+        }
+
+        unsigned mask = _mm256_movemask_ps(inside);
+        while (mask) {
+            visible[count++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return count + cullScalar<BOXES>(planes, x, y, z, ex, ey, ez, i, n, visible + count);
+}
+
+
+// Sixteen at a time, with the visible indices written by a compress store
+template<bool BOXES>
+__attribute__((target("avx512f")))
+unsigned cullAvx512(const Planes & planes, const float * x, const float * y, const float * z,
+                    const float * ex, const float * ey, const float * ez, unsigned n, unsigned * visible) {
+    __m512 a[6], b[6], c[6], d[6], absA[6], absB[6], absC[6];
+    for (int p=0; p<6; ++p) {
+        a[p] = _mm512_set1_ps(planes[0][p]);
+        b[p] = _mm512_set1_ps(planes[1][p]);
+        c[p] = _mm512_set1_ps(planes[2][p]);
+        d[p] = _mm512_set1_ps(planes[3][p]);
+        absA[p] = _mm512_set1_ps(fabsf(planes[0][p]));
+        absB[p] = _mm512_set1_ps(fabsf(planes[1][p]));
+        absC[p] = _mm512_set1_ps(fabsf(planes[2][p]));
+    }
+
+    unsigned count = 0;
+    unsigned i = 0;
+    __m512 zero = _mm512_setzero_ps();
+    __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    for (; i + 16 <= n; i += 16) {
+        __m512 vx = _mm512_loadu_ps(&x[i]);
+        __m512 vy = _mm512_loadu_ps(&y[i]);
+        __m512 vz = _mm512_loadu_ps(&z[i]);
+        __m512 vex = _mm512_loadu_ps(&ex[i]);
+        __m512 vey = BOXES ? _mm512_loadu_ps(&ey[i]) : zero;
+        __m512 vez = BOXES ? _mm512_loadu_ps(&ez[i]) : zero;
+
+        __mmask16 inside = 0xffff;
+        for (int p=0; p<6; ++p) {
+            __m512 dist = _mm512_fmadd_ps(a[p], vx, _mm512_fmadd_ps(b[p], vy, _mm512_fmadd_ps(c[p], vz, d[p])));
+            if (BOXES) {
+                dist = _mm512_fmadd_ps(absA[p], vex, _mm512_fmadd_ps(absB[p], vey, _mm512_fmadd_ps(absC[p], vez, dist)));
+            } else {
+                dist = _mm512_add_ps(dist, vex);
+            }
+            inside = _mm512_mask_cmp_ps_mask(inside, dist, zero, _CMP_GE_OQ);
+        }
+
+        _mm512_mask_compressstoreu_epi32(&visible[count], inside, _mm512_add_epi32(lanes, _mm512_set1_epi32(i)));
+        count += __builtin_popcount(inside);
+    }
+    return count + cullScalar<BOXES>(planes, x, y, z, ex, ey, ez, i, n, visible + count);
+}
+
+
+template<bool BOXES>
+unsigned cull(const Planes & planes, const float * x, const float * y, const float * z,
+              const float * ex, const float * ey, const float * ez, unsigned n, unsigned * visible) {
+    switch (Matrix4::kernel()) {
+    case Matrix4::KERNEL_AVX512:
+        return cullAvx512<BOXES>(planes, x, y, z, ex, ey, ez, n, visible);
+    case Matrix4::KERNEL_AVX2:
+        return cullAvx2<BOXES>(planes, x, y, z, ex, ey, ez, n, visible);
+    default:
+        return cullSse<BOXES>(planes, x, y, z, ex, ey, ez, n, visible);
+    }
+}
+
+
+}
+
+
+Frustum::Frustum() {
+    // Everything is inside
+    for (int p=0; p<PLANES; ++p) {
+        _planes[0][p] = 0.0f;
+        _planes[1][p] = 0.0f;
+        _planes[2][p] = 0.0f;
+        _planes[3][p] = 1.0f;
+    }
+}
+
+
+Frustum::Frustum(const Matrix4 & projectionView) {
+    // Each plane is the last row of the matrix plus or minus one of the
+    // others, as clip space is -w <= x, y, z <= w
+    const float * m = projectionView.data();
+    for (int p=0; p<PLANES; ++p) {
+        int row = p / 2;
+        float sign = p % 2 ? -1.0f : 1.0f;
+        float plane[4];
+        for (int i=0; i<4; ++i) {
+            plane[i] = m[12 + i] + sign * m[4*row + i];
+        }
+
+        float length = sqrtf(plane[0]*plane[0] + plane[1]*plane[1] + plane[2]*plane[2]);
+        for (int i=0; i<4; ++i) {
+            _planes[i][p] = plane[i] / length;
+        }
+    }
+}
+
+
+unsigned Frustum::cullSpheres(const float * x, const float * y, const float * z, const float * radius,
+                              unsigned n, unsigned * visible) const {
+    return cull<false>(_planes, x, y, z, radius, nullptr, nullptr, n, visible);
+}
+
+
+unsigned Frustum::cullBoxes(const float * x, const float * y, const float * z,
+                            const float * extentX, const float * extentY, const float * extentZ,
+                            unsigned n, unsigned * visible) const {
+    return cull<true>(_planes, x, y, z, extentX, extentY, extentZ, n, visible);
+}
+
+
+bool Frustum::containsSphere(float x, float y, float z, float radius) const {
+    return visibleScalar<false>(_planes, x, y, z, radius, 0.0f, 0.0f);
+}
+
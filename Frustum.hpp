@@ -0,0 +1,42 @@
+#ifndef Frustum_hpp
+#define Frustum_hpp
+
+#include "Matrix4.hpp"
+
+
+// The six planes of a view frustum, for culling bounding volumes on the CPU.
+// The bulk tests take structure of arrays input and use the same SIMD level
+// as Matrix4::kernel().
+class Frustum {
+public:
+    Frustum();
+
+    // Extracts the planes from a combined projection and view matrix, as
+    // computed by GLApp::updateMatrices
+    explicit Frustum(const Matrix4 & projectionView);
+
+    // Writes the indices of the spheres that touch the frustum to visible,
+    // which must have room for n, and returns how many there are. Indices
+    // are in increasing order.
+    unsigned cullSpheres(const float * x, const float * y, const float * z, const float * radius,
+                         unsigned n, unsigned * visible) const;
+
+    // As cullSpheres for axis aligned boxes given by centre and half extents
+    unsigned cullBoxes(const float * x, const float * y, const float * z,
+                       const float * extentX, const float * extentY, const float * extentZ,
+                       unsigned n, unsigned * visible) const;
+
+    bool containsSphere(float x, float y, float z, float radius) const;
+
+private:
+    enum {
+        PLANES = 6,
+    };
+
+    // Planes as normal x, y, z and distance, each row one component of all
+    // six, normalised so distances are in world units
+    float _planes[4][PLANES];
+};
+
+
+#endif
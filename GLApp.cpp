@@ -1,85 +1,351 @@
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <thread>
 
 #include "GLApp.hpp"
+#include "GLState.hpp"
 
 
-const double GLApp::PHYSICS_RESOLUTION = 25e-3;
-const float GLApp::MOVEMENT_SPEED = 0.1f;
-const float GLApp::LOOK_SPEED = 0.01f;
+namespace {
 
 
-GLApp::GLApp() :
-    _cameraX(0.0f),
-    _cameraY(0.0f),
-    _cameraZ(0.0f),
-    _cameraPitch(0.0f),
-    _cameraYaw(0.0f),
-    _keysDown(0) {
+// Names the shaders are looked up by
+constexpr uint32_t FRAME = nameHash("Frame");
+constexpr uint32_t VERTEX_POSITION = nameHash("vertexPosition");
+constexpr uint32_t VERTEX_NORMAL = nameHash("vertexNormal");
+constexpr uint32_t INSTANCE_POSITION_SCALE = nameHash("instancePositionScale");
+constexpr uint32_t INSTANCE_ROTATION = nameHash("instanceRotation");
 
-    // Set basic opengl properties
-    glClearColor(0.4f, 0.6f, 0.9f, 0.0f);
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_CULL_FACE);
-    glEnable(GL_FRAMEBUFFER_SRGB);
-    glEnable(GL_PRIMITIVE_RESTART);
-    glPrimitiveRestartIndex(65535);
-    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-
-    // Link sharer
-    Shader vertexShader(GL_VERTEX_SHADER);
-    vertexShader.load(
+
+// Normals for the flat test triangles
+const float FACING_Z[] = {
+    0.0f, 0.0f, 1.0f,
+    0.0f, 0.0f, 1.0f,
+    0.0f, 0.0f, 1.0f,
+};
+
+
+// Set once a frame for every program, laid out as std140 has it. The
+// quantisation box is the same every frame, but is here so that no draw
+// needs state of its own.
+struct FrameUniforms {
+    float projectionViewMatrix[16];
+    float quantisationOffset[4];
+    float quantisationScale[4];
+};
+
+
+}
+
+
+// Spliced into shader sources that use FrameUniforms
+#define FRAME_BLOCK \
+"layout(std140, row_major) uniform Frame {\n" \
+"   mat4 projectionViewMatrix;\n" \
+"   vec4 quantisationOffset;\n" \
+"   vec4 quantisationScale;\n" \
+"};\n"
+
+
+namespace {
+
+
+// Every variant of the shaders, picked by GLApp::VARIANT_ bits
+const char * const shaderFeatures[] = {
+    "INSTANCED",
+};
+
+
+const ProgramCache::Source shaderSources[] = {
+    {GL_VERTEX_SHADER,
 "#version 330 core\n"
 "#line " S__LINE__ "\n"
 "in vec3 vertexPosition;\n"
-"uniform mat4 projectionViewMatrix;\n"
+"in vec2 vertexNormal;\n"
+"out vec3 normal;\n"
+FRAME_BLOCK
+"vec3 decodeOctahedral(vec2 e) {\n"
+"   vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));\n"
+"   if (n.z < 0.0) {\n"
+"       n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);\n"
+"   }\n"
+"   return normalize(n);\n"
+"}\n"
+"#ifdef INSTANCED\n"
+"in vec4 instancePositionScale;\n"
+"in vec4 instanceRotation;\n"
+"vec3 rotate(vec4 q, vec3 v) {\n"
+"   return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);\n"
+"}\n"
+"#endif\n"
 "void main() {\n"
-"   gl_Position = projectionViewMatrix * vec4(vertexPosition, 1.0);\n"
+"   vec3 position = quantisationOffset.xyz + vertexPosition * quantisationScale.xyz;\n"
+"   normal = decodeOctahedral(vertexNormal);\n"
+"#ifdef INSTANCED\n"
+"   position = rotate(instanceRotation, position * instancePositionScale.w) + instancePositionScale.xyz;\n"
+"   normal = rotate(instanceRotation, normal);\n"
+"#endif\n"
+"   gl_Position = projectionViewMatrix * vec4(position, 1.0);\n"
 "}\n"
-    );
-    Shader fragmentShader(GL_FRAGMENT_SHADER);
-    fragmentShader.load(
+    },
+    {GL_FRAGMENT_SHADER,
 "#version 330 core\n"
 "#line " S__LINE__ "\n"
+"in vec3 normal;\n"
 "out vec4 color;\n"
 "void main() {\n"
-"   color = vec4(1.0, 0.0, 0.0, 1.0);\n"
+"   float facing = abs(normalize(normal).z);\n"
+"   color = vec4((0.5 + 0.5 * facing) * vec3(1.0, 0.0, 0.0), 1.0);\n"
 "}\n"
-    );
-    _mainShader.attach(std::move(vertexShader));
-    _mainShader.attach(std::move(fragmentShader));
-    _mainShader.link();
-    _projectionViewMatrixLoc = _mainShader.getUniformLoc("projectionViewMatrix");
+    },
+};
+
+
+}
+
+
+const double GLApp::PHYSICS_RESOLUTION = 25e-3;
+const float GLApp::MOVEMENT_SPEED = 0.1f;
+const float GLApp::LOOK_SPEED = 0.01f;
+const unsigned GLApp::DEFRAG_BUDGET = 64 * 1024;
+const unsigned GLApp::STAGING_SIZE = 4 * 1024 * 1024;
+const unsigned GLApp::GEOMETRY_PAGE_SIZE = 16 * 1024 * 1024;
+const unsigned GLApp::LOADER_CHUNK_SIZE = 256 * 1024;
+const unsigned GLApp::UNIFORM_RING_SIZE = 64 * 1024;
+const float GLApp::FIELD_OF_VIEW = 60.0f;
+const float GLApp::NEAR_PLANE = 1.0f;
+const float GLApp::FAR_PLANE = 100.0f;
+const float GLApp::SPIN_SPEED = 2.0f;
+// Meshes must lie within this of the origin on every axis, or PackedMesh
+// rejects them. addTestMeshes closes its grid up to stay inside, so the
+// triangles start to overlap past about 400000 of them.
+const float GLApp::SCENE_EXTENT = 64.0f;
+
+
+GLApp::GLApp(ProgramCache & programCache) :
+    _programCache(programCache),
+    _shaders(programCache, shaderSources, 2, shaderFeatures, SHADER_FEATURES),
+    _cameraX(0.0f),
+    _cameraY(0.0f),
+    _cameraZ(0.0f),
+    _cameraPitch(0.0f),
+    _cameraYaw(0.0f),
+    _keysDown(0),
+    _time(0.0f) {
+
+    // Set basic opengl properties
+    glClearColor(0.4f, 0.6f, 0.9f, 0.0f);
+    GLState::setEnabled(GL_DEPTH_TEST, true);
+    GLState::setEnabled(GL_CULL_FACE, true);
+    GLState::setEnabled(GL_FRAMEBUFFER_SRGB, true);
+    GLState::setEnabled(GL_PRIMITIVE_RESTART, true);
+    GLState::polygonMode(GL_LINE);
+
+    // Start on the plain variant, which is always drawn
+    _shaders.prepare(0);
 
     // Allocate buffers
-    _vertexBuffer = BufferAllocator(1024, GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW);
-    _indexBuffer = BufferAllocator(1024, GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW);
+    _staging = StagingRing(STAGING_SIZE);
+    _meshes = MeshRegistry<Vertex>(GEOMETRY_PAGE_SIZE, GL_DYNAMIC_DRAW, &_staging);
+    _uniforms = UniformRing(UNIFORM_RING_SIZE);
 
     // Load some data
-    static const float data[] = {
+    static const float positions[] = {
         -0.5f, -0.5f, -3.5f,
         0.5f, -0.5f, -3.5f,
         0.0f, 0.5f, -3.5f,
     };
-    _vertexRef = _vertexBuffer.allocate((void*)data, sizeof(data));
-    static const int indices[] = {
+    static const uint32_t indices[] = {
         0, 1, 2
     };
-    _indexRef = _indexBuffer.allocate((void*)indices, sizeof(indices));
+    addMesh(positions, FACING_Z, 3, indices, 3, false);
+    _shaders.bindUniformBlock(FRAME, FRAME_BINDING);
+}
 
-    // Setup VAO
-    glGenVertexArrays(1, &_vertexArray);
-    glBindVertexArray(_vertexArray);
 
-    glBindBuffer(GL_ARRAY_BUFFER, *_vertexBuffer);
-    glVertexAttribPointer(_mainShader.getAttributeLoc("vertexPosition"), 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-    glEnableVertexAttribArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+GLApp::~GLApp() {
+    for (const InstanceBatch & batch : _instanceBatches) {
+        GLState::deleteBuffers(1, &batch.buffer);
+        if (batch.vertexArray) {
+            GLState::deleteVertexArrays(1, &batch.vertexArray);
+        }
+    }
+    for (const auto & vertexArray : _vertexArrays) {
+        GLState::deleteVertexArrays(1, &vertexArray.second);
+    }
+}
+
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, *_indexBuffer);
+void GLApp::addTestMeshes(unsigned count, unsigned threads) {
+    // A square grid of small triangles, further back than the first one
+    unsigned side = unsigned(ceilf(sqrtf(float(count))));
+    static const uint32_t indices[] = {
+        0, 1, 2
+    };
+    if (!threads) {
+        std::vector<PackedMesh> packed;
+        packed.reserve(count);
+        for (unsigned i=0; i<count; ++i) {
+            packed.push_back(testMesh(i, side));
+        }
+
+        // Upload them all at once, as a scene load would
+        std::vector<MeshRegistry<Vertex>::Source> sources;
+        for (const PackedMesh & mesh : packed) {
+            sources.push_back({mesh.vertices().data(), 3, indices, 3, mesh.centre(), mesh.radius()});
+        }
+        _meshes.addBatch(sources.data(), sources.size());
+        _instanceOnly.resize(_meshes.size(), false);
+        return;
+    }
 
-    glBindVertexArray(0);
+    // Each worker packs and stages every threads'th mesh, while this thread
+    // does the uploads and hands them fresh chunks
+    MeshRegistry<Vertex>::Loader loader(_meshes, count, LOADER_CHUNK_SIZE);
+    std::atomic<unsigned> running(threads);
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::thread> workers;
+    for (unsigned t=0; t<threads; ++t) {
+        workers.emplace_back([&, t] {
+            try {
+                MeshRegistry<Vertex>::Loader::Arena arena(loader);
+                for (unsigned i=t; i<count; i+=threads) {
+                    PackedMesh mesh = testMesh(i, side);
+                    arena.add({mesh.vertices().data(), 3, indices, 3, mesh.centre(), mesh.radius()}, i);
+                }
+            } catch (...) {
+                errors[t] = std::current_exception();
+            }
+            --running;
+        });
+    }
+    while (running) {
+        loader.flush();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    for (unsigned t=0; t<threads; ++t) {
+        workers[t].join();
+        if (errors[t]) {
+            std::rethrow_exception(errors[t]);
+        }
+    }
+    loader.finish();
+    _instanceOnly.resize(_meshes.size(), false);
+}
+
+
+void GLApp::addTestInstances(unsigned count) {
+    if (!count) {
+        return;
+    }
+
+    // One triangle centred on the origin, for the instances to place
+    static const float positions[] = {
+        -0.1f, -0.1f, 0.0f,
+        0.1f, -0.1f, 0.0f,
+        0.0f, 0.1f, 0.0f,
+    };
+    static const uint32_t indices[] = {
+        0, 1, 2
+    };
+    _shaders.prepare(VARIANT_INSTANCED);
+    InstanceBatch batch;
+    batch.mesh = addMesh(positions, FACING_Z, 3, indices, 3, true);
+
+    // Rotation moves the mesh's sphere about the origin, so bound that
+    unsigned mesh = batch.mesh;
+    float meshRadius = sqrtf(_meshes.boundsX()[mesh] * _meshes.boundsX()[mesh] +
+                             _meshes.boundsY()[mesh] * _meshes.boundsY()[mesh] +
+                             _meshes.boundsZ()[mesh] * _meshes.boundsZ()[mesh]) + _meshes.boundsRadius()[mesh];
+
+    unsigned side = unsigned(ceilf(sqrtf(float(count))));
+    for (unsigned i=0; i<count; ++i) {
+        Instance instance = {
+            (float(i % side) - side * 0.5f) * 0.3f,
+            (float(i / side) - side * 0.5f) * 0.3f,
+            -10.0f,
+            1.0f,
+            {0.0f, 0.0f, 0.0f, 1.0f},
+        };
+        batch.instances.push_back(instance);
+        batch.boundsX.push_back(instance.x);
+        batch.boundsY.push_back(instance.y);
+        batch.boundsZ.push_back(instance.z);
+        batch.boundsRadius.push_back(meshRadius * instance.scale);
+    }
+
+    glGenBuffers(1, &batch.buffer);
+    batch.vertexArray = 0;
+    _instanceBatches.push_back(std::move(batch));
+}
+
+
+PackedMesh::Quantisation GLApp::sceneQuantisation() {
+    PackedMesh::Quantisation quantisation = {
+        {0.0f, 0.0f, 0.0f},
+        {SCENE_EXTENT, SCENE_EXTENT, SCENE_EXTENT},
+    };
+    return quantisation;
+}
+
+
+PackedMesh GLApp::testMesh(unsigned i, unsigned side) {
+    // Half a unit apart, or closer if that would leave the scene box
+    float spacing = std::min(0.5f, (SCENE_EXTENT - 0.2f) * 2.0f / side);
+    float x = (float(i % side) - side * 0.5f) * spacing;
+    float y = (float(i / side) - side * 0.5f) * spacing;
+    float positions[] = {
+        x - 0.1f, y - 0.1f, -20.0f,
+        x + 0.1f, y - 0.1f, -20.0f,
+        x, y + 0.1f, -20.0f,
+    };
+    return PackedMesh(positions, FACING_Z, 3, sceneQuantisation());
+}
+
+
+MeshRegistry<GLApp::Vertex>::Id GLApp::addMesh(const float * positions, const float * normals, unsigned vertexCount,
+                                                 const uint32_t * indices, unsigned indexCount, bool instanceOnly) {
+    PackedMesh packed(positions, normals, vertexCount, sceneQuantisation());
+    MeshRegistry<Vertex>::Id id = _meshes.add(packed.vertices().data(), vertexCount, indices, indexCount,
+                                              packed.centre(), packed.radius());
+    _instanceOnly.push_back(instanceOnly);
+    return id;
+}
+
+
+void GLApp::setVertexAttributes(ShaderProgram & shader, unsigned vertexPage) {
+    unsigned vertexPositionLoc = shader.attribute(VERTEX_POSITION);
+    unsigned vertexNormalLoc = shader.attribute(VERTEX_NORMAL);
+    GLState::bindBuffer(GL_ARRAY_BUFFER, _meshes.vertexBuffer().buffer(vertexPage));
+    glVertexAttribPointer(vertexPositionLoc, 3, GL_SHORT, GL_TRUE, sizeof(Vertex), (void*)offsetof(Vertex, x));
+    glEnableVertexAttribArray(vertexPositionLoc);
+    glVertexAttribPointer(vertexNormalLoc, 2, GL_BYTE, GL_TRUE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+    glEnableVertexAttribArray(vertexNormalLoc);
+}
+
+
+unsigned GLApp::vertexArray(const MeshRegistry<Vertex>::Mesh & mesh) {
+    unsigned & vertexArray = _vertexArrays[std::make_tuple(mesh.vertexPage(), mesh.indexPage(), mesh.wideIndices())];
+    if (vertexArray) {
+        return vertexArray;
+    }
+
+    // Setup VAO
+    glGenVertexArrays(1, &vertexArray);
+    GLState::bindVertexArray(vertexArray);
+    setVertexAttributes(_shaders.get(0), mesh.vertexPage());
+    GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, _meshes.indexBufferOf(mesh));
+
+    return vertexArray;
 }
 
 
@@ -94,16 +360,14 @@ void GLApp::resize(int w, int h) {
 
 void GLApp::updateMatrices() {
     // Create projection matrix
-    float fieldOfView = 60.0f;
-    float nearPlane = 1.0f;
-    float farPlane = 100.0f;
-    Matrix4 projectionMatrix = Matrix4::createProjectionMatrix(fieldOfView, _aspectRatio, nearPlane, farPlane);
+    Matrix4 projectionMatrix = Matrix4::createProjectionMatrix(FIELD_OF_VIEW, _aspectRatio, NEAR_PLANE, FAR_PLANE);
 
     // Create view matrix
-    Matrix4 viewMatrix = Matrix4::createViewMatrix(_cameraX, _cameraY, _cameraZ, _cameraPitch, _cameraYaw);
+    AffineMatrix4 viewMatrix = Matrix4::createViewMatrix(_cameraX, _cameraY, _cameraZ, _cameraPitch, _cameraYaw);
 
     // Save composite transformation
     _transformMatrix = projectionMatrix * viewMatrix;
+    _frustum = Frustum(_transformMatrix);
 }
 
 
@@ -111,20 +375,134 @@ void GLApp::render() {
     // Setup matrix
     updateMatrices();
 
+    // Land this frame's uploads
+    _staging.flush();
+    _uniforms.beginFrame();
+
+    // Pack a little more of the geometry buffers each frame
+    _meshes.vertexBuffer().defragment(DEFRAG_BUDGET);
+    _meshes.indexBuffer().defragment(DEFRAG_BUDGET);
+    _meshes.wideIndexBuffer().defragment(DEFRAG_BUDGET);
+
     // Clear buffer
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    _renderQueue.clear();
+
+    // Set the frame's uniforms once for every program
+    FrameUniforms frame;
+    memcpy(frame.projectionViewMatrix, _transformMatrix.data(), sizeof(frame.projectionViewMatrix));
+    PackedMesh::Quantisation quantisation = sceneQuantisation();
+    for (int axis=0; axis<3; ++axis) {
+        frame.quantisationOffset[axis] = quantisation.offset[axis];
+        frame.quantisationScale[axis] = quantisation.scale[axis];
+    }
+    frame.quantisationOffset[3] = 0.0f;
+    frame.quantisationScale[3] = 0.0f;
+    _uniforms.push(FRAME_BINDING, &frame, sizeof(frame));
+    unsigned program = *_shaders.get(0);
+
+    // Skip anything out of view
+    _visible.resize(_meshes.size());
+    unsigned visible = _frustum.cullSpheres(_meshes.boundsX(), _meshes.boundsY(), _meshes.boundsZ(), _meshes.boundsRadius(),
+                                            _meshes.size(), _visible.data());
+    _visible.resize(visible);
+
+    // Queue the indexed draws, keyed by their VAO and then by depth. Clip
+    // space w is the distance along the view direction.
+    const float * m = _transformMatrix.data();
+    for (unsigned i : _visible) {
+        if (_instanceOnly[i]) {
+            continue;
+        }
+        const MeshRegistry<Vertex>::Mesh & mesh = _meshes[i];
+        unsigned vao = vertexArray(mesh);
+        float depth = m[12]*_meshes.boundsX()[i] + m[13]*_meshes.boundsY()[i] + m[14]*_meshes.boundsZ()[i] + m[15];
+
+        RenderQueue::Draw draw = {program, vao, mesh.indexCount(), mesh.firstIndex(), mesh.baseVertex(), 1, mesh.indexType()};
+        _renderQueue.push(RenderQueue::makeKey(0, program, vao, depth / FAR_PLANE), draw);
+    }
+    for (InstanceBatch & batch : _instanceBatches) {
+        queueInstances(batch);
+    }
+    _renderQueue.submit();
+
+    // Anything freed this frame can be reused once these draws complete
+    _meshes.vertexBuffer().endFrame();
+    _meshes.indexBuffer().endFrame();
+    _meshes.wideIndexBuffer().endFrame();
+    _uniforms.endFrame();
+
+    // Keep any variants built this frame
+    _programCache.update();
+}
+
+
+void GLApp::queueInstances(InstanceBatch & batch) {
+    // Stream the visible instances, orphaning last frame's
+    _visible.resize(batch.instances.size());
+    unsigned visible = _frustum.cullSpheres(batch.boundsX.data(), batch.boundsY.data(), batch.boundsZ.data(), batch.boundsRadius.data(),
+                                            batch.instances.size(), _visible.data());
+    if (!visible) {
+        return;
+    }
+    _visibleInstances.resize(visible);
+    for (unsigned i=0; i<visible; ++i) {
+        _visibleInstances[i] = batch.instances[_visible[i]];
+    }
+    GLState::bindBuffer(GL_ARRAY_BUFFER, batch.buffer);
+    glBufferData(GL_ARRAY_BUFFER, batch.instances.size() * sizeof(Instance), nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, visible * sizeof(Instance), _visibleInstances.data());
+
+    const MeshRegistry<Vertex>::Mesh & mesh = _meshes[batch.mesh];
+    ShaderProgram & shader = _shaders.get(VARIANT_INSTANCED);
+    if (!batch.vertexArray) {
+        // Mesh attributes advance per vertex and the instance ones per
+        // instance
+        unsigned positionScaleLoc = shader.attribute(INSTANCE_POSITION_SCALE);
+        unsigned rotationLoc = shader.attribute(INSTANCE_ROTATION);
+        glGenVertexArrays(1, &batch.vertexArray);
+        GLState::bindVertexArray(batch.vertexArray);
+        setVertexAttributes(shader, mesh.vertexPage());
+
+        GLState::bindBuffer(GL_ARRAY_BUFFER, batch.buffer);
+        glVertexAttribPointer(positionScaleLoc, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)offsetof(Instance, x));
+        glVertexAttribDivisor(positionScaleLoc, 1);
+        glEnableVertexAttribArray(positionScaleLoc);
+        glVertexAttribPointer(rotationLoc, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)offsetof(Instance, rotation));
+        glVertexAttribDivisor(rotationLoc, 1);
+        glEnableVertexAttribArray(rotationLoc);
+
+        GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, _meshes.indexBufferOf(mesh));
+    }
+
+    unsigned program = *shader;
+    RenderQueue::Draw draw = {program, batch.vertexArray, mesh.indexCount(), mesh.firstIndex(), mesh.baseVertex(), visible, mesh.indexType()};
+    _renderQueue.push(RenderQueue::makeKey(0, program, batch.vertexArray, 0.0f), draw);
+}
+
+
+void GLApp::writeAllocatorStats(std::ostream & os, double time, bool json) const {
+    if (json) {
+        _meshes.vertexBuffer().stats().writeJson(os, time, "vertex");
+        _meshes.indexBuffer().stats().writeJson(os, time, "index");
+        _meshes.wideIndexBuffer().stats().writeJson(os, time, "wideindex");
+    } else {
+        _meshes.vertexBuffer().stats().writeCsv(os, time, "vertex");
+        _meshes.indexBuffer().stats().writeCsv(os, time, "index");
+        _meshes.wideIndexBuffer().stats().writeCsv(os, time, "wideindex");
+    }
+}
 
-    // Setup shader
-    glUseProgram(*_mainShader);
-    glUniformMatrix4fv(_projectionViewMatrixLoc, 1, GL_TRUE, _transformMatrix.data());
 
-    // Indexed draw
-    glBindVertexArray(_vertexArray);
-    glDrawElements(GL_TRIANGLES, 3, GL_UNSIGNED_INT, 0);
-    glBindVertexArray(0);
+void GLApp::writeShaderStats(std::ostream & os) const {
+    _shaders.writeSummary(os);
+}
 
-    // Disable shader
-    glUseProgram(0);
+
+void GLApp::setAllocatorTrace(std::ostream * os) {
+    _meshes.vertexBuffer().setTrace(os, "vertex");
+    _meshes.indexBuffer().setTrace(os, "index");
+    _meshes.wideIndexBuffer().setTrace(os, "wideindex");
 }
 
 
@@ -163,6 +541,17 @@ void GLApp::onMouse(int dx, int dy) {
 
 
 void GLApp::update() {
+    // Spin the instances in place, each a little out of step
+    _time += PHYSICS_RESOLUTION;
+    for (InstanceBatch & batch : _instanceBatches) {
+        for (unsigned i=0; i<batch.instances.size(); ++i) {
+            float halfAngle = (_time * SPIN_SPEED + i * 0.1f) * 0.5f;
+            float * rotation = batch.instances[i].rotation;
+            rotation[2] = sinf(halfAngle);
+            rotation[3] = cosf(halfAngle);
+        }
+    }
+
     if (_keysDown & KEY_W) {
         _cameraZ -= MOVEMENT_SPEED;
     }
@@ -1,9 +1,22 @@
 #ifndef GLApp_hpp
 #define GLApp_hpp
 
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <tuple>
+#include <vector>
+
+#include "Frustum.hpp"
 #include "Matrix4.hpp"
-#include "BufferAllocator.hpp"
+#include "MeshRegistry.hpp"
+#include "PackedMesh.hpp"
+#include "ProgramCache.hpp"
+#include "RenderQueue.hpp"
+#include "StagingRing.hpp"
 #include "Shader.hpp"
+#include "ShaderVariants.hpp"
+#include "UniformRing.hpp"
 
 
 class GLApp {
@@ -11,8 +24,21 @@ public:
     static const double PHYSICS_RESOLUTION;
     static const float MOVEMENT_SPEED;
     static const float LOOK_SPEED;
+    static const unsigned DEFRAG_BUDGET;
+    static const unsigned STAGING_SIZE;
+    static const unsigned GEOMETRY_PAGE_SIZE;
+    static const unsigned LOADER_CHUNK_SIZE;
+    static const unsigned UNIFORM_RING_SIZE;
+    static const float FIELD_OF_VIEW;
+    static const float NEAR_PLANE;
+    static const float FAR_PLANE;
+    static const float SPIN_SPEED;
+    static const float SCENE_EXTENT;
 
-    GLApp();
+    explicit GLApp(ProgramCache & programCache);
+    GLApp(const GLApp &) = delete;
+    GLApp & operator=(const GLApp &) = delete;
+    ~GLApp();
 
     void resize(int w, int h);
     void onKey(char key, bool pressed);
@@ -21,9 +47,74 @@ public:
     void render();
     void update();
 
+    // Scatters copies of the triangle over a grid behind it, to load the
+    // renderer with many small meshes. They are packed and staged on
+    // threads worker threads, or all on this one if that is 0.
+    void addTestMeshes(unsigned count, unsigned threads);
+
+    // Adds a grid of spinning triangles in front of the first one, drawn
+    // with one instanced draw
+    void addTestInstances(unsigned count);
+
+    // Appends a CSV row, or a JSON line, per geometry allocator
+    void writeAllocatorStats(std::ostream & os, double time, bool json) const;
+
+    // One line summary of the shader variants built
+    void writeShaderStats(std::ostream & os) const;
+
+    // Records geometry allocations for replaying in AllocatorBench
+    void setAllocatorTrace(std::ostream * os);
+
+    // Draw and state change counts for the last frame
+    const RenderQueue::Stats & renderStats() const {
+        return _renderQueue.stats();
+    }
+
 private:
+    typedef PackedMesh::Vertex Vertex;
+
+    // Position, uniform scale and a unit quaternion, as the instanced
+    // shader reads them
+    struct Instance {
+        float x, y, z, scale;
+        float rotation[4];
+    };
+
+    // Instances of one mesh. They are streamed each frame into their own
+    // buffer, so they always start at instance 0.
+    struct InstanceBatch {
+        MeshRegistry<Vertex>::Id mesh;
+        std::vector<Instance> instances;
+
+        // Bounding spheres of the instances, split by component for culling
+        std::vector<float> boundsX;
+        std::vector<float> boundsY;
+        std::vector<float> boundsZ;
+        std::vector<float> boundsRadius;
+
+        unsigned buffer;
+        unsigned vertexArray;
+    };
+
     void updateMatrices();
 
+    // The box every mesh is quantised across, SCENE_EXTENT either side of
+    // the origin
+    static PackedMesh::Quantisation sceneQuantisation();
+
+    // Mesh i of addTestMeshes' grid, which is side meshes across
+    static PackedMesh testMesh(unsigned i, unsigned side);
+
+    // Packs and registers a mesh
+    MeshRegistry<Vertex>::Id addMesh(const float * positions, const float * normals, unsigned vertexCount,
+                                     const uint32_t * indices, unsigned indexCount, bool instanceOnly);
+
+    // Points the bound VAO's mesh attributes at a vertex page
+    void setVertexAttributes(ShaderProgram & shader, unsigned vertexPage);
+
+    unsigned vertexArray(const MeshRegistry<Vertex>::Mesh & mesh);
+    void queueInstances(InstanceBatch & batch);
+
     enum {
         KEY_W = 1,
         KEY_A = 2,
@@ -31,18 +122,39 @@ private:
         KEY_D = 8,
     };
 
+    enum {
+        FRAME_BINDING = 0,
+    };
+
+    // Shader variant bits
+    enum {
+        VARIANT_INSTANCED = 1,
+        SHADER_FEATURES = 1,
+    };
+
     Matrix4         _transformMatrix;
+    Frustum         _frustum;
+
+    // Uploads are queued here and copied into place once per frame
+    StagingRing         _staging;
+
+    // Per frame uniforms shared by every program
+    UniformRing         _uniforms;
+
+    MeshRegistry<Vertex> _meshes;
+    std::vector<bool>   _instanceOnly;  // meshes only drawn as instances
+
+    std::vector<unsigned> _visible;
+    RenderQueue         _renderQueue;
 
-    // Vertex format is x,y,z as signed shorts
-    BufferAllocator     _vertexBuffer;
-    BufferAllocator     _indexBuffer;
+    std::vector<InstanceBatch> _instanceBatches;
+    std::vector<Instance> _visibleInstances;
 
-    BufferAllocator::Ref    _vertexRef;
-    BufferAllocator::Ref    _indexRef;
+    // One VAO per vertex page, index page and index width
+    std::map<std::tuple<unsigned, unsigned, bool>, unsigned> _vertexArrays;
 
-    ShaderProgram       _mainShader;
-    unsigned            _vertexArray;
-    unsigned            _projectionViewMatrixLoc;
+    ProgramCache &      _programCache;
+    ShaderVariants      _shaders;
 
     float           _cameraX;
     float           _cameraY;
@@ -51,6 +163,7 @@ private:
     float           _cameraYaw;
     float           _aspectRatio;
     uint32_t        _keysDown;
+    float           _time;
 };
 
 
@@ -0,0 +1,317 @@
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "GLState.hpp"
+
+
+namespace {
+
+
+// Never a real name or value, so the next call always goes through
+const unsigned UNKNOWN = ~0u;
+
+
+// The element array binding lives in the VAO
+const int ELEMENT_ARRAY = 1;
+const int UNIFORM = 4;
+
+
+const GLenum bufferTargets[] = {
+    GL_ARRAY_BUFFER,
+    GL_ELEMENT_ARRAY_BUFFER,
+    GL_COPY_READ_BUFFER,
+    GL_COPY_WRITE_BUFFER,
+    GL_UNIFORM_BUFFER,
+    GL_DRAW_INDIRECT_BUFFER,
+};
+const GLenum bufferBindings[] = {
+    GL_ARRAY_BUFFER_BINDING,
+    GL_ELEMENT_ARRAY_BUFFER_BINDING,
+    GL_COPY_READ_BUFFER_BINDING,
+    GL_COPY_WRITE_BUFFER_BINDING,
+    GL_UNIFORM_BUFFER_BINDING,
+    GL_DRAW_INDIRECT_BUFFER_BINDING,
+};
+const GLenum caps[] = {
+    GL_BLEND,
+    GL_CULL_FACE,
+    GL_DEPTH_TEST,
+    GL_FRAMEBUFFER_SRGB,
+    GL_PRIMITIVE_RESTART,
+};
+
+
+template<size_t N>
+int find(const GLenum (&table)[N], GLenum value) {
+    for (size_t i=0; i<N; ++i) {
+        if (table[i] == value) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+bool validationRequested() {
+    const char * env = getenv("GLDEMO_VALIDATE_STATE");
+    return env && strcmp(env, "0");
+}
+
+
+}
+
+
+GLState::State GLState::_state = {
+    {UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN},
+    {},
+    UNKNOWN,
+    UNKNOWN,
+    {UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN, UNKNOWN},
+    UNKNOWN,
+    0,
+    false,
+};
+GLState::Stats GLState::_stats = {0, 0};
+bool GLState::_validate = validationRequested();
+
+
+void GLState::bindBuffer(unsigned target, unsigned buffer) {
+    int i = find(bufferTargets, target);
+    if (i < 0) {
+        // Not tracked, so always issue it
+        ++_stats.issued;
+        glBindBuffer(target, buffer);
+    } else if (changed(_state.buffers[i], buffer)) {
+        glBindBuffer(target, buffer);
+    }
+    checkValid();
+}
+
+
+void GLState::bindBufferRange(unsigned target, unsigned index, unsigned buffer, intptr_t offset, intptr_t sz) {
+    int i = find(bufferTargets, target);
+    if (target != GL_UNIFORM_BUFFER || index >= UNIFORM_BINDINGS) {
+        ++_stats.issued;
+        glBindBufferRange(target, index, buffer, offset, sz);
+        if (i >= 0) {
+            _state.buffers[i] = buffer;
+        }
+        checkValid();
+        return;
+    }
+
+    Range & range = _state.uniformBuffers[index];
+    if (range.buffer == buffer && range.offset == unsigned(offset) && range.sz == unsigned(sz)) {
+        ++_stats.skipped;
+    } else {
+        ++_stats.issued;
+        glBindBufferRange(target, index, buffer, offset, sz);
+        range.buffer = buffer;
+        range.offset = offset;
+        range.sz = sz;
+        _state.buffers[UNIFORM] = buffer;
+    }
+    checkValid();
+}
+
+
+void GLState::bindVertexArray(unsigned vertexArray) {
+    if (changed(_state.vertexArray, vertexArray)) {
+        glBindVertexArray(vertexArray);
+        _state.buffers[ELEMENT_ARRAY] = UNKNOWN;
+    }
+    checkValid();
+}
+
+
+void GLState::useProgram(unsigned program) {
+    if (changed(_state.program, program)) {
+        glUseProgram(program);
+    }
+    checkValid();
+}
+
+
+void GLState::setEnabled(unsigned cap, bool enabled) {
+    int i = find(caps, cap);
+    if (i < 0) {
+        ++_stats.issued;
+    } else if (!changed(_state.caps[i], enabled)) {
+        checkValid();
+        return;
+    }
+    if (enabled) {
+        glEnable(cap);
+    } else {
+        glDisable(cap);
+    }
+    checkValid();
+}
+
+
+void GLState::polygonMode(unsigned mode) {
+    // Core profiles only allow setting both faces at once
+    if (changed(_state.polygonMode, mode)) {
+        glPolygonMode(GL_FRONT_AND_BACK, mode);
+    }
+    checkValid();
+}
+
+
+void GLState::primitiveRestartIndex(unsigned index) {
+    if (_state.restartIndexKnown && _state.restartIndex == index) {
+        ++_stats.skipped;
+    } else {
+        ++_stats.issued;
+        glPrimitiveRestartIndex(index);
+        _state.restartIndex = index;
+        _state.restartIndexKnown = true;
+    }
+    checkValid();
+}
+
+
+void GLState::deleteBuffers(int n, const unsigned * buffers) {
+    glDeleteBuffers(n, buffers);
+    for (int i=0; i<n; ++i) {
+        for (unsigned & bound : _state.buffers) {
+            if (bound == buffers[i]) {
+                bound = 0;
+            }
+        }
+        for (Range & range : _state.uniformBuffers) {
+            if (range.buffer == buffers[i]) {
+                range = Range{0, 0, 0};
+            }
+        }
+    }
+}
+
+
+void GLState::deleteVertexArrays(int n, const unsigned * vertexArrays) {
+    glDeleteVertexArrays(n, vertexArrays);
+    for (int i=0; i<n; ++i) {
+        if (_state.vertexArray == vertexArrays[i]) {
+            _state.vertexArray = 0;
+            _state.buffers[ELEMENT_ARRAY] = UNKNOWN;
+        }
+    }
+}
+
+
+void GLState::deleteProgram(unsigned program) {
+    // A program in use stays current until replaced, but its name can be
+    // handed out again
+    glDeleteProgram(program);
+    if (_state.program == program) {
+        _state.program = UNKNOWN;
+    }
+}
+
+
+void GLState::invalidate() {
+    for (unsigned & buffer : _state.buffers) {
+        buffer = UNKNOWN;
+    }
+    for (Range & range : _state.uniformBuffers) {
+        range = Range{UNKNOWN, UNKNOWN, UNKNOWN};
+    }
+    _state.vertexArray = UNKNOWN;
+    _state.program = UNKNOWN;
+    for (unsigned & cap : _state.caps) {
+        cap = UNKNOWN;
+    }
+    _state.polygonMode = UNKNOWN;
+    _state.restartIndexKnown = false;
+}
+
+
+void GLState::setValidation(bool validate) {
+    _validate = validate;
+}
+
+
+void GLState::validate() {
+    auto check = [](const char * name, unsigned cached, GLint actual) {
+        if (cached != UNKNOWN && cached != unsigned(actual)) {
+            throw std::runtime_error(std::string("GL state cache out of sync: ") + name + " is " +
+                                     std::to_string(actual) + ", cached " + std::to_string(cached));
+        }
+    };
+
+    GLint value;
+    static const char * const bufferNames[] = {
+        "array buffer", "element array buffer", "copy read buffer", "copy write buffer", "uniform buffer", "draw indirect buffer"
+    };
+    for (int i=0; i<BUFFER_TARGETS; ++i) {
+        // Indirect draws are GL 4.0, which a 3.3 context may not have
+        if (bufferTargets[i] == GL_DRAW_INDIRECT_BUFFER && !(GLEW_VERSION_4_0 || GLEW_ARB_draw_indirect)) {
+            continue;
+        }
+        glGetIntegerv(bufferBindings[i], &value);
+        check(bufferNames[i], _state.buffers[i], value);
+    }
+    for (int i=0; i<UNIFORM_BINDINGS; ++i) {
+        // Deleting a buffer zeroes the binding but not its range
+        const Range & range = _state.uniformBuffers[i];
+        glGetIntegeri_v(GL_UNIFORM_BUFFER_BINDING, i, &value);
+        check("indexed uniform buffer", range.buffer, value);
+        if (range.buffer && range.buffer != UNKNOWN) {
+            GLint64 value64;
+            glGetInteger64i_v(GL_UNIFORM_BUFFER_START, i, &value64);
+            check("indexed uniform buffer start", range.offset, value64);
+            glGetInteger64i_v(GL_UNIFORM_BUFFER_SIZE, i, &value64);
+            check("indexed uniform buffer size", range.sz, value64);
+        }
+    }
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &value);
+    check("vertex array", _state.vertexArray, value);
+    glGetIntegerv(GL_CURRENT_PROGRAM, &value);
+    check("program", _state.program, value);
+    static const char * const capNames[] = {"blend", "cull face", "depth test", "sRGB framebuffer", "primitive restart"};
+    for (int i=0; i<CAPS; ++i) {
+        check(capNames[i], _state.caps[i], glIsEnabled(caps[i]));
+    }
+    GLint modes[2];
+    glGetIntegerv(GL_POLYGON_MODE, modes);
+    check("polygon mode", _state.polygonMode, modes[0]);
+    if (_state.restartIndexKnown) {
+        glGetIntegerv(GL_PRIMITIVE_RESTART_INDEX, &value);
+        if (unsigned(value) != _state.restartIndex) {
+            throw std::runtime_error("GL state cache out of sync: primitive restart index is " +
+                                     std::to_string(unsigned(value)) + ", cached " + std::to_string(_state.restartIndex));
+        }
+    }
+}
+
+
+void GLState::resetStats() {
+    _stats.issued = 0;
+    _stats.skipped = 0;
+}
+
+
+bool GLState::changed(unsigned & cached, unsigned value) {
+    if (cached == value) {
+        ++_stats.skipped;
+        return false;
+    }
+    cached = value;
+    ++_stats.issued;
+    return true;
+}
+
+
+void GLState::checkValid() {
+#ifndef NDEBUG
+    if (_validate) {
+        validate();
+    }
+#endif
+}
+
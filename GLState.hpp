@@ -0,0 +1,89 @@
+#ifndef GLState_hpp
+#define GLState_hpp
+
+#include <cstdint>
+
+
+// Shadow copy of the GL bindings and switches the renderer touches, so a
+// call that would set what is already set is skipped. Everything that binds
+// buffers, vertex arrays or programs, or deletes them, has to come through
+// here or call invalidate. There is one GL context at a time, so the state
+// is static.
+//
+// Builds without NDEBUG can check the shadow copy against glGet after each
+// call, with setValidation or GLDEMO_VALIDATE_STATE=1, and throw on a
+// mismatch.
+class GLState {
+public:
+    struct Stats {
+        uint64_t issued;
+        uint64_t skipped;
+    };
+
+    static void bindBuffer(unsigned target, unsigned buffer);
+
+    // Binds to an indexed binding point, which also sets the target's
+    // generic binding. Uniform buffer points below UNIFORM_BINDINGS are
+    // tracked.
+    static void bindBufferRange(unsigned target, unsigned index, unsigned buffer, intptr_t offset, intptr_t sz);
+    static void bindVertexArray(unsigned vertexArray);
+    static void useProgram(unsigned program);
+    static void setEnabled(unsigned cap, bool enabled);
+    static void polygonMode(unsigned mode);
+    static void primitiveRestartIndex(unsigned index);
+
+    // Deleting unbinds in GL too, and a name may then be reused
+    static void deleteBuffers(int n, const unsigned * buffers);
+    static void deleteVertexArrays(int n, const unsigned * vertexArrays);
+    static void deleteProgram(unsigned program);
+
+    // Forgets everything, for a new context or after GL calls made around
+    // the cache
+    static void invalidate();
+
+    static void setValidation(bool validate);
+
+    // Throws if the shadow copy disagrees with GL
+    static void validate();
+
+    static const Stats & stats() {
+        return _stats;
+    }
+    static void resetStats();
+
+private:
+    enum {
+        BUFFER_TARGETS = 6,
+        CAPS = 5,
+        UNIFORM_BINDINGS = 8,
+    };
+
+    struct Range {
+        unsigned buffer;
+        unsigned offset;
+        unsigned sz;
+    };
+
+    struct State {
+        unsigned buffers[BUFFER_TARGETS];
+        Range    uniformBuffers[UNIFORM_BINDINGS];
+        unsigned vertexArray;
+        unsigned program;
+        unsigned caps[CAPS];
+        unsigned polygonMode;
+
+        // Any value is a valid index, so whether it is known is kept apart
+        unsigned restartIndex;
+        bool     restartIndexKnown;
+    };
+
+    static bool changed(unsigned & cached, unsigned value);
+    static void checkValid();
+
+    static State _state;
+    static Stats _stats;
+    static bool _validate;
+};
+
+
+#endif
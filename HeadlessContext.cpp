@@ -0,0 +1,91 @@
+
+#define EGL_NO_X11
+#include <GL/glew.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "GLState.hpp"
+#include "HeadlessContext.hpp"
+
+
+HeadlessContext::HeadlessContext() :
+    _display(EGL_NO_DISPLAY),
+    _context(EGL_NO_CONTEXT) {
+
+    // Prefer the surfaceless platform, it needs neither X nor a GPU
+    EGLDisplay display = EGL_NO_DISPLAY;
+    const char * extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (extensions && strstr(extensions, "EGL_MESA_platform_surfaceless")) {
+        PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (getPlatformDisplay) {
+            display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+        }
+    }
+    if (display == EGL_NO_DISPLAY) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr)) {
+        throw std::runtime_error("Failed to initialise EGL");
+    }
+    _display = display;
+
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        eglTerminate(display);
+        throw std::runtime_error("EGL does not support desktop OpenGL");
+    }
+
+    // Any config will do, everything is drawn into framebuffer objects
+    static const EGLint configAttribs[] = {
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_SURFACE_TYPE, 0,
+        EGL_NONE,
+    };
+    EGLConfig config;
+    EGLint configCount = 0;
+    if (!eglChooseConfig(display, configAttribs, &config, 1, &configCount) || !configCount) {
+        eglTerminate(display);
+        throw std::runtime_error("No suitable EGL config");
+    }
+
+    static const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE,
+    };
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+    if (context == EGL_NO_CONTEXT) {
+        eglTerminate(display);
+        throw std::runtime_error("Failed to create an OpenGL 3.3 core context");
+    }
+    _context = context;
+    if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        eglDestroyContext(display, context);
+        eglTerminate(display);
+        throw std::runtime_error("Failed to make the context current");
+    }
+
+    // glewInit wants a GLX display, this only loads the GL entry points
+    glewExperimental = GL_TRUE;
+    GLenum err = glewContextInit();
+    if (err != GLEW_OK) {
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(display, context);
+        eglTerminate(display);
+        throw std::runtime_error(std::string("Failed to load OpenGL: ") + (const char*)glewGetErrorString(err));
+    }
+    glGetError(); // glew is odd an leaves behind an error
+    GLState::invalidate();
+}
+
+
+HeadlessContext::~HeadlessContext() {
+    eglMakeCurrent(_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(_display, _context);
+    eglTerminate(_display);
+}
+
@@ -0,0 +1,22 @@
+#ifndef HeadlessContext_hpp
+#define HeadlessContext_hpp
+
+
+// An OpenGL 3.3 core context with no window, made current on construction.
+// Uses EGL with the Mesa surfaceless platform where available, so it works
+// on machines with no display or GPU, e.g. with llvmpipe. There is no
+// default framebuffer, so render into a Framebuffer.
+class HeadlessContext {
+public:
+    HeadlessContext();
+    HeadlessContext(const HeadlessContext &) = delete;
+    HeadlessContext & operator=(const HeadlessContext &) = delete;
+    ~HeadlessContext();
+
+private:
+    void * _display;
+    void * _context;
+};
+
+
+#endif
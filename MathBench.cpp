@@ -0,0 +1,458 @@
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "Frustum.hpp"
+#include "Matrix4.hpp"
+#include "PackedMesh.hpp"
+
+
+// Times the Matrix4 multiply and transform kernels and Frustum culling
+// against each other on the same data, checking that they agree with the
+// SSE fallback. Times and checks the inverses too, and packing vertices
+// with PackedMesh, checking how far positions and normals move on the way
+// through.
+//
+//   MathBench          run every kernel the CPU supports
+
+
+namespace {
+
+
+typedef std::chrono::steady_clock Clock;
+
+
+const unsigned MATRICES = 4096;
+const unsigned POINTS = 16384;
+const unsigned VOLUMES = 16384;
+const unsigned PACKED_VERTICES = 65536;
+const unsigned PASSES = 500;
+const unsigned REPEATS = 5;    // best of, to dodge noise
+const float PACKED_EXTENT = 50.0f;
+const float MAX_NORMAL_ERROR = 1.5f;    // degrees
+const float MAX_INVERSE_ERROR = 1e-4f;  // from the identity, on any element
+
+
+// Keeps results from being optimised away
+volatile float sink;
+
+
+struct Result {
+    double throughput;  // independent multiplies, ns each
+    double latency;     // dependent chain of *=, ns each
+    double batch;       // multiplyBatch, ns per matrix
+    double points;      // transformPoints, ns per point
+    double checksum;
+};
+
+
+Matrix4 randomMatrix(std::mt19937 & rng) {
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    return Matrix4::createViewMatrix(dist(rng), dist(rng), dist(rng), dist(rng), dist(rng));
+}
+
+
+// Largest difference of any element from the identity
+float identityError(const Matrix4 & matrix) {
+    float error = 0.0f;
+    for (int i=0; i<16; ++i) {
+        float expected = i % 5 ? 0.0f : 1.0f;
+        error = std::max(error, std::fabs(matrix.data()[i] - expected));
+    }
+    return error;
+}
+
+
+double checksum(const std::vector<Matrix4> & matrices) {
+    double sum = 0.0;
+    for (const Matrix4 & matrix : matrices) {
+        for (int i=0; i<16; ++i) {
+            sum += matrix.data()[i];
+        }
+    }
+    return sum;
+}
+
+
+Result run(const std::vector<Matrix4> & lhs, const std::vector<Matrix4> & rhs, const std::vector<float> & points) {
+    Result result;
+    std::vector<Matrix4> out(lhs.size());
+
+    // Throughput, every multiply is independent
+    Clock::time_point start = Clock::now();
+    for (unsigned pass=0; pass<PASSES; ++pass) {
+        for (unsigned i=0; i<lhs.size(); ++i) {
+            out[i] = lhs[i] * rhs[i];
+        }
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    result.throughput = seconds * 1e9 / (double(PASSES) * lhs.size());
+    result.checksum = checksum(out);
+
+    // Latency, each multiply waits on the last
+    Matrix4 chain = lhs[0];
+    start = Clock::now();
+    for (unsigned pass=0; pass<PASSES; ++pass) {
+        for (unsigned i=0; i<lhs.size(); ++i) {
+            chain *= lhs[i];
+        }
+    }
+    seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    result.latency = seconds * 1e9 / (double(PASSES) * lhs.size());
+    sink = chain.data()[0];
+
+    // The same products as the throughput pass, but a call per batch
+    start = Clock::now();
+    for (unsigned pass=0; pass<PASSES; ++pass) {
+        Matrix4::multiplyBatch(lhs[pass % lhs.size()], rhs.data(), out.data(), rhs.size());
+    }
+    seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    result.batch = seconds * 1e9 / (double(PASSES) * rhs.size());
+    sink = out[0].data()[0];
+
+    // Points held as x, y and z arrays one after the other
+    size_t n = points.size() / 3;
+    std::vector<float> transformed(n * 4);
+    start = Clock::now();
+    for (unsigned pass=0; pass<PASSES; ++pass) {
+        Matrix4::transformPoints(lhs[pass % lhs.size()], &points[0], &points[n], &points[2 * n],
+                                 &transformed[0], &transformed[n], &transformed[2 * n], &transformed[3 * n], n);
+    }
+    seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    result.points = seconds * 1e9 / (double(PASSES) * n);
+    sink = transformed[0];
+    return result;
+}
+
+
+// Time per call of op over every matrix, best of REPEATS
+template<typename T, typename Op>
+double timeEach(const std::vector<T> & matrices, Op op) {
+    double best = 0.0;
+    for (unsigned repeat=0; repeat<REPEATS; ++repeat) {
+        Matrix4 acc = matrices[0];
+        Clock::time_point start = Clock::now();
+        for (unsigned pass=0; pass<PASSES; ++pass) {
+            for (unsigned i=0; i+1<matrices.size(); ++i) {
+                op(matrices[i], matrices[i + 1], acc);
+            }
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        double each = seconds * 1e9 / (double(PASSES) * (matrices.size() - 1));
+        best = repeat ? std::min(best, each) : each;
+        sink = acc.data()[0];
+    }
+    return best;
+}
+
+
+struct CullResult {
+    double spheres;     // ns per sphere
+    double boxes;       // ns per box
+    unsigned visible;
+};
+
+
+// Volumes scattered around the camera so a fraction are in view
+struct Volumes {
+    std::vector<float> x, y, z, radius, extentX, extentY, extentZ;
+};
+
+
+CullResult cull(const Frustum & frustum, const Volumes & volumes) {
+    CullResult result;
+    unsigned n = volumes.x.size();
+    std::vector<unsigned> visible(n);
+
+    Clock::time_point start = Clock::now();
+    for (unsigned pass=0; pass<PASSES; ++pass) {
+        result.visible = frustum.cullSpheres(volumes.x.data(), volumes.y.data(), volumes.z.data(), volumes.radius.data(),
+                                             n, visible.data());
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    result.spheres = seconds * 1e9 / (double(PASSES) * n);
+
+    start = Clock::now();
+    for (unsigned pass=0; pass<PASSES; ++pass) {
+        frustum.cullBoxes(volumes.x.data(), volumes.y.data(), volumes.z.data(),
+                          volumes.extentX.data(), volumes.extentY.data(), volumes.extentZ.data(), n, visible.data());
+    }
+    seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    result.boxes = seconds * 1e9 / (double(PASSES) * n);
+    return result;
+}
+
+
+struct PackResult {
+    double vertex;          // ns per vertex packed
+    float positionError;    // largest on any axis
+    float normalError;      // degrees
+};
+
+
+// Packs random unit normals at random positions in the box, and unpacks
+// them as the shader does
+PackResult pack(const std::vector<float> & positions, const std::vector<float> & normals) {
+    PackResult result;
+    unsigned n = positions.size() / 3;
+    PackedMesh::Quantisation quantisation = {
+        {0.0f, 0.0f, 0.0f},
+        {PACKED_EXTENT, PACKED_EXTENT, PACKED_EXTENT},
+    };
+
+    double best = 0.0;
+    for (unsigned repeat=0; repeat<REPEATS; ++repeat) {
+        Clock::time_point start = Clock::now();
+        PackedMesh mesh(positions.data(), normals.data(), n, quantisation);
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        best = repeat ? std::min(best, seconds) : seconds;
+        sink = mesh.radius();
+    }
+    result.vertex = best * 1e9 / n;
+
+    PackedMesh mesh(positions.data(), normals.data(), n, quantisation);
+    result.positionError = 0.0f;
+    result.normalError = 0.0f;
+    for (unsigned i=0; i<n; ++i) {
+        const PackedMesh::Vertex & vertex = mesh.vertices()[i];
+        const int16_t packed[3] = {vertex.x, vertex.y, vertex.z};
+        for (int axis=0; axis<3; ++axis) {
+            float position = quantisation.offset[axis] + std::max(packed[axis] / 32767.0f, -1.0f) * quantisation.scale[axis];
+            result.positionError = std::max(result.positionError, std::fabs(position - positions[i*3 + axis]));
+        }
+
+        float encoded[2] = {std::max(vertex.normal[0] / 127.0f, -1.0f), std::max(vertex.normal[1] / 127.0f, -1.0f)};
+        float normal[3];
+        PackedMesh::decodeOctahedral(encoded, normal);
+        float cosine = normal[0] * normals[i*3] + normal[1] * normals[i*3 + 1] + normal[2] * normals[i*3 + 2];
+        float degrees = std::acos(std::min(cosine, 1.0f)) * 180.0f / 3.14159265f;
+        result.normalError = std::max(result.normalError, degrees);
+    }
+    return result;
+}
+
+
+}
+
+
+int main() {
+    std::mt19937 rng(1234);
+    std::vector<Matrix4> lhs, rhs;
+    for (unsigned i=0; i<MATRICES; ++i) {
+        lhs.push_back(randomMatrix(rng));
+        rhs.push_back(randomMatrix(rng));
+    }
+    std::uniform_real_distribution<float> dist(-100.0f, 100.0f);
+    std::vector<float> points(POINTS * 3);
+    for (float & point : points) {
+        point = dist(rng);
+    }
+
+    std::cout << "best kernel: " << Matrix4::kernelName(Matrix4::bestKernel()) << std::endl;
+    std::cout << std::left << std::setw(9) << "kernel"
+              << std::right << std::setw(12) << "ns/mul"
+              << std::setw(12) << "ns/chain"
+              << std::setw(12) << "ns/batch"
+              << std::setw(12) << "ns/point"
+              << std::setw(10) << "speedup"
+              << std::setw(14) << "checksum"
+              << std::endl;
+
+    double baseline = 0.0;
+    double baseChecksum = 0.0;
+    bool agree = true;
+    for (Matrix4::Kernel kernel : {Matrix4::KERNEL_SSE, Matrix4::KERNEL_AVX2, Matrix4::KERNEL_AVX512}) {
+        if (!Matrix4::setKernel(kernel)) {
+            std::cout << std::left << std::setw(9) << Matrix4::kernelName(kernel) << "unsupported" << std::endl;
+            continue;
+        }
+        Result result = run(lhs, rhs, points);
+        for (unsigned i=1; i<REPEATS; ++i) {
+            Result repeat = run(lhs, rhs, points);
+            result.throughput = std::min(result.throughput, repeat.throughput);
+            result.latency = std::min(result.latency, repeat.latency);
+            result.batch = std::min(result.batch, repeat.batch);
+            result.points = std::min(result.points, repeat.points);
+        }
+        if (kernel == Matrix4::KERNEL_SSE) {
+            baseline = result.throughput;
+            baseChecksum = result.checksum;
+        }
+
+        // FMA rounds differently, so only expect close agreement
+        if (std::fabs(result.checksum - baseChecksum) > 1e-3 * std::fabs(baseChecksum) + 1e-3) {
+            agree = false;
+        }
+        std::cout << std::left << std::setw(9) << Matrix4::kernelName(kernel)
+                  << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(12) << result.throughput
+                  << std::setw(12) << result.latency
+                  << std::setw(12) << result.batch
+                  << std::setw(12) << result.points
+                  << std::setw(10) << baseline / result.throughput
+                  << std::setprecision(4)
+                  << std::setw(14) << result.checksum
+                  << std::endl;
+    }
+
+    // Inverses and affine products. The products go through the kernels,
+    // so time them with the one that would be picked.
+    Matrix4::setKernel(Matrix4::bestKernel());
+    std::vector<AffineMatrix4> affine;
+    for (unsigned i=0; i<MATRICES; ++i) {
+        affine.push_back(Matrix4::createViewMatrix(dist(rng), dist(rng), dist(rng), dist(rng) * 0.01f, dist(rng) * 0.01f));
+    }
+    std::cout << std::endl << std::left << std::setw(20) << "operation" << std::right << std::setw(12) << "ns"
+              << "  (" << Matrix4::kernelName(Matrix4::kernel()) << ")" << std::endl;
+    auto report = [](const char * name, double ns) {
+        std::cout << std::left << std::setw(20) << name << std::right << std::fixed << std::setprecision(2) << std::setw(12) << ns << std::endl;
+    };
+    report("general *", timeEach(lhs, [](const Matrix4 & a, const Matrix4 & b, Matrix4 & acc) {
+        acc = a * b;
+    }));
+    report("affine *", timeEach(affine, [](const AffineMatrix4 & a, const AffineMatrix4 & b, Matrix4 & acc) {
+        acc = a * b;
+    }));
+    report("inverse", timeEach(lhs, [](const Matrix4 & a, const Matrix4 &, Matrix4 & acc) {
+        acc = a.inverse();
+    }));
+    report("affineInverse", timeEach(lhs, [](const Matrix4 & a, const Matrix4 &, Matrix4 & acc) {
+        acc = a.affineInverse();
+    }));
+    report("normalMatrix", timeEach(lhs, [](const Matrix4 & a, const Matrix4 &, Matrix4 & acc) {
+        acc = a.normalMatrix();
+    }));
+    report("transpose", timeEach(lhs, [](const Matrix4 & a, const Matrix4 &, Matrix4 & acc) {
+        acc = a.transpose();
+    }));
+
+    // Inverses must undo the matrix, including a projection for the general one
+    Matrix4 projection = Matrix4::createProjectionMatrix(60.0f, 16.0f / 9.0f, 1.0f, 100.0f);
+    float inverseError = 0.0f;
+    for (const Matrix4 & a : lhs) {
+        Matrix4 general = projection * a;
+        inverseError = std::max(inverseError, identityError(a.inverse() * a));
+        inverseError = std::max(inverseError, identityError(a.affineInverse() * a));
+        inverseError = std::max(inverseError, identityError(general.inverse() * general));
+    }
+    std::cout << std::left << std::setw(20) << "inverse error" << std::right << std::scientific << std::setprecision(2)
+              << std::setw(12) << inverseError << std::endl;
+
+    // Scales by powers of two invert exactly, and the translation must not
+    // leak into the normal matrix
+    Matrix4 scale = Matrix4::createTranslationMatrix(3.0f, -1.0f, 7.0f) * Matrix4::createScaleMatrix(2.0f, 4.0f, 0.5f);
+    const float expectedNormal[16] = {
+        0.5f, 0.0f, 0.0f, 0.0f,
+        0.0f, 0.25f, 0.0f, 0.0f,
+        0.0f, 0.0f, 2.0f, 0.0f,
+        0.0f, 0.0f, 0.0f, 1.0f,
+    };
+    bool inverts = inverseError <= MAX_INVERSE_ERROR &&
+                   std::equal(expectedNormal, expectedNormal + 16, scale.normalMatrix().data());
+
+    // Culling
+    Volumes volumes;
+    std::uniform_real_distribution<float> size(0.5f, 4.0f);
+    for (unsigned i=0; i<VOLUMES; ++i) {
+        volumes.x.push_back(dist(rng));
+        volumes.y.push_back(dist(rng));
+        volumes.z.push_back(dist(rng));
+        volumes.radius.push_back(size(rng));
+        volumes.extentX.push_back(size(rng));
+        volumes.extentY.push_back(size(rng));
+        volumes.extentZ.push_back(size(rng));
+    }
+    Frustum frustum(Matrix4::createProjectionMatrix(60.0f, 16.0f / 9.0f, 1.0f, 100.0f) *
+                    Matrix4::createViewMatrix(0.0f, 0.0f, 0.0f, 0.1f, 0.7f));
+
+    std::cout << std::endl
+              << std::left << std::setw(9) << "kernel"
+              << std::right << std::setw(12) << "ns/sphere"
+              << std::setw(12) << "ns/box"
+              << std::setw(10) << "visible"
+              << std::endl;
+    unsigned baseVisible = 0;
+    for (Matrix4::Kernel kernel : {Matrix4::KERNEL_SSE, Matrix4::KERNEL_AVX2, Matrix4::KERNEL_AVX512}) {
+        if (!Matrix4::setKernel(kernel)) {
+            continue;
+        }
+        CullResult result = cull(frustum, volumes);
+        for (unsigned i=1; i<REPEATS; ++i) {
+            CullResult repeat = cull(frustum, volumes);
+            result.spheres = std::min(result.spheres, repeat.spheres);
+            result.boxes = std::min(result.boxes, repeat.boxes);
+        }
+        if (kernel == Matrix4::KERNEL_SSE) {
+            baseVisible = result.visible;
+        } else if (result.visible != baseVisible) {
+            agree = false;
+        }
+        std::cout << std::left << std::setw(9) << Matrix4::kernelName(kernel)
+                  << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(12) << result.spheres
+                  << std::setw(12) << result.boxes
+                  << std::setw(10) << result.visible
+                  << std::endl;
+    }
+    Matrix4::setKernel(Matrix4::bestKernel());
+
+    // Vertex packing
+    std::uniform_real_distribution<float> inBox(-PACKED_EXTENT, PACKED_EXTENT);
+    std::normal_distribution<float> gaussian;
+    std::vector<float> positions(PACKED_VERTICES * 3);
+    std::vector<float> normals(PACKED_VERTICES * 3);
+    for (unsigned i=0; i<PACKED_VERTICES; ++i) {
+        float * normal = &normals[i*3];
+        float length = 0.0f;
+        while (length < 1e-3f) {
+            for (int axis=0; axis<3; ++axis) {
+                positions[i*3 + axis] = inBox(rng);
+                normal[axis] = gaussian(rng);
+            }
+            length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        }
+        for (int axis=0; axis<3; ++axis) {
+            normal[axis] /= length;
+        }
+    }
+    PackResult packed = pack(positions, normals);
+    std::cout << std::endl
+              << std::left << std::setw(9) << "pack"
+              << std::right << std::setw(12) << "ns/vertex"
+              << std::setw(14) << "position err"
+              << std::setw(14) << "normal deg"
+              << std::endl
+              << std::left << std::setw(9) << ""
+              << std::right << std::fixed << std::setprecision(2)
+              << std::setw(12) << packed.vertex
+              << std::setprecision(6)
+              << std::setw(14) << packed.positionError
+              << std::setprecision(3)
+              << std::setw(14) << packed.normalError
+              << std::endl;
+
+    // Rounding to the nearest step is at most half a step out, give or take
+    // float rounding
+    bool packs = packed.positionError <= PACKED_EXTENT / 32767.0f * 0.5f * 1.01f &&
+                 packed.normalError <= MAX_NORMAL_ERROR;
+
+    if (!agree) {
+        std::cerr << "Error: kernels disagree" << std::endl;
+        return 1;
+    }
+    if (!inverts) {
+        std::cerr << "Error: inverses are out of tolerance" << std::endl;
+        return 1;
+    }
+    if (!packs) {
+        std::cerr << "Error: packed vertices are out of tolerance" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
@@ -1,11 +1,83 @@
 
 #include <iostream>
 #include <cmath>
-#include <emmintrin.h>
+#include <immintrin.h>
 
 #include "Matrix4.hpp"
 
 
+namespace {
+
+
+template<int I>
+__m128 splat(__m128 v) {
+    return _mm_shuffle_ps(v, v, _MM_SHUFFLE(I, I, I, I));
+}
+
+
+__m128 maskXyz() {
+    return _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+}
+
+
+__m128 sum(__m128 v) {
+    v = _mm_add_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_add_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+}
+
+
+__m128 cross(__m128 a, __m128 b) {
+    // a x b = (a * b.yzx - a.yzx * b).yzx
+    __m128 aYzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 bYzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(a, bYzx), _mm_mul_ps(aYzx, b));
+    return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1));
+}
+
+
+// The upper 3x3 of m as columns of its inverse, before dividing by the
+// determinant. They are also the rows of the inverse transpose.
+void cofactors(const float * m, __m128 & c0, __m128 & c1, __m128 & c2, __m128 & det) {
+    __m128 r0 = _mm_and_ps(_mm_load_ps(&m[0]), maskXyz());
+    __m128 r1 = _mm_and_ps(_mm_load_ps(&m[4]), maskXyz());
+    __m128 r2 = _mm_and_ps(_mm_load_ps(&m[8]), maskXyz());
+    c0 = cross(r1, r2);
+    c1 = cross(r2, r0);
+    c2 = cross(r0, r1);
+    det = sum(_mm_mul_ps(r0, c0));
+}
+
+
+// 2x2 matrices held row-major in one register
+__m128 mat2Mul(__m128 a, __m128 b) {
+    return _mm_add_ps(_mm_mul_ps(a, _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 3, 0))),
+                      _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)), _mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 2, 1, 2))));
+}
+
+
+// adj(a) * b
+__m128 mat2AdjMul(__m128 a, __m128 b) {
+    return _mm_sub_ps(_mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(0, 0, 3, 3)), b),
+                      _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 2, 1, 1)), _mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 0, 3, 2))));
+}
+
+
+// a * adj(b)
+__m128 mat2MulAdj(__m128 a, __m128 b) {
+    return _mm_sub_ps(_mm_mul_ps(a, _mm_shuffle_ps(b, b, _MM_SHUFFLE(0, 3, 0, 3))),
+                      _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)), _mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 2, 1, 2))));
+}
+
+
+}
+
+
+Matrix4::Kernel Matrix4::_kernel = Matrix4::KERNEL_SSE;
+Matrix4::Kernels Matrix4::_kernels = {multiplySse, multiplyAffineSse, multiplyBatchSse, transformSse};
+bool Matrix4::_kernelSet = false;
+bool Matrix4::_kernelUpgraded = Matrix4::upgradeKernel();
+
+
 Matrix4 Matrix4::createProjectionMatrix(float fieldOfView, float aspectRatio, float nearPlane, float farPlane) {
     float focalLength = 1.0f / tanf(fieldOfView * float(0.5 * 2.0 * M_PI / 360.0));
     float invDepth = 1.0f / (nearPlane - farPlane);
@@ -19,24 +91,28 @@ Matrix4 Matrix4::createProjectionMatrix(float fieldOfView, float aspectRatio, fl
 }
 
 
-Matrix4 Matrix4::createViewMatrix(float cameraX, float cameraY, float cameraZ, float cameraPitch, float cameraYaw) {
-    float yawSin = sinf(cameraYaw);
-    float yawCos = cosf(cameraYaw);
-    float pitchSin = sinf(cameraPitch);
-    float pitchCos = cosf(cameraPitch);
+AffineMatrix4 Matrix4::createViewMatrix(float cameraX, float cameraY, float cameraZ, float cameraPitch, float cameraYaw) {
+    return createRotationMatrix(cameraPitch, cameraYaw) * createTranslationMatrix(-cameraX, -cameraY, -cameraZ);
+}
 
-    Matrix4 ret;
+
+AffineMatrix4 Matrix4::createRotationMatrix(float pitch, float yaw) {
+    float yawSin = sinf(yaw);
+    float yawCos = cosf(yaw);
+    float pitchSin = sinf(pitch);
+    float pitchCos = cosf(pitch);
+
+    AffineMatrix4 ret;
     _mm_store_ps(&ret._x[0], _mm_setr_ps(yawCos,            0,                  -yawSin,            0.0f));
     _mm_store_ps(&ret._x[4], _mm_setr_ps(yawSin*pitchSin,   pitchCos,           pitchSin*yawCos,    0.0f));
     _mm_store_ps(&ret._x[8], _mm_setr_ps(yawSin*pitchCos,   -pitchSin,          yawCos*pitchCos,    0.0f));
     _mm_store_ps(&ret._x[12], _mm_setr_ps(0.0f,             0.0f,               0.0f,               1.0f));
-
-    return ret * createTranslationMatrix(-cameraX, -cameraY, -cameraZ);
+    return ret;
 }
 
 
-Matrix4 Matrix4::createTranslationMatrix(float x, float y, float z) {
-    Matrix4 ret;
+AffineMatrix4 Matrix4::createTranslationMatrix(float x, float y, float z) {
+    AffineMatrix4 ret;
     _mm_store_ps(&ret._x[0], _mm_setr_ps(1.0f, 0.0f, 0.0f, x));
     _mm_store_ps(&ret._x[4], _mm_setr_ps(0.0f, 1.0f, 0.0f, y));
     _mm_store_ps(&ret._x[8], _mm_setr_ps(0.0f, 0.0f, 1.0f, z));
@@ -45,43 +121,549 @@ Matrix4 Matrix4::createTranslationMatrix(float x, float y, float z) {
 }
 
 
+AffineMatrix4 Matrix4::createScaleMatrix(float x, float y, float z) {
+    AffineMatrix4 ret;
+    _mm_store_ps(&ret._x[0], _mm_setr_ps(x, 0.0f, 0.0f, 0.0f));
+    _mm_store_ps(&ret._x[4], _mm_setr_ps(0.0f, y, 0.0f, 0.0f));
+    _mm_store_ps(&ret._x[8], _mm_setr_ps(0.0f, 0.0f, z, 0.0f));
+    _mm_store_ps(&ret._x[12], _mm_setr_ps(0.0f, 0.0f, 0.0f, 1.0f));
+    return ret;
+}
+
+
 Matrix4 Matrix4::operator*(const Matrix4 & rhs) const {
     Matrix4 ret;
-    __m128 row1 = _mm_load_ps(&rhs._x[0]);
-    __m128 row2 = _mm_load_ps(&rhs._x[4]);
-    __m128 row3 = _mm_load_ps(&rhs._x[8]);
-    __m128 row4 = _mm_load_ps(&rhs._x[12]);
-    for (int i=0; i<4; i++) {
-        __m128 brod1 = _mm_set1_ps(_x[4*i + 0]);
-        __m128 brod2 = _mm_set1_ps(_x[4*i + 1]);
-        __m128 brod3 = _mm_set1_ps(_x[4*i + 2]);
-        __m128 brod4 = _mm_set1_ps(_x[4*i + 3]);
-        __m128 row = _mm_add_ps(_mm_add_ps(_mm_mul_ps(brod1, row1), _mm_mul_ps(brod2, row2)),
-                                _mm_add_ps(_mm_mul_ps(brod3, row3), _mm_mul_ps(brod4, row4)));
-        _mm_store_ps(&ret._x[4*i], row);
-    }
+    _kernels.multiply(_x, rhs._x, ret._x);
     return ret;
 }
 
 
 Matrix4 & Matrix4::operator*=(const Matrix4 & rhs) {
-    __m128 row1 = _mm_load_ps(&rhs._x[0]);
-    __m128 row2 = _mm_load_ps(&rhs._x[4]);
-    __m128 row3 = _mm_load_ps(&rhs._x[8]);
-    __m128 row4 = _mm_load_ps(&rhs._x[12]);
+    _kernels.multiply(_x, rhs._x, _x);
+    return *this;
+}
+
+
+Matrix4 Matrix4::operator*(const AffineMatrix4 & rhs) const {
+    Matrix4 ret;
+    _kernels.multiplyAffine(_x, rhs._x, ret._x);
+    return ret;
+}
+
+
+Matrix4 & Matrix4::operator*=(const AffineMatrix4 & rhs) {
+    _kernels.multiplyAffine(_x, rhs._x, _x);
+    return *this;
+}
+
+
+Matrix4 Matrix4::transpose() const {
+    __m128 row1 = _mm_load_ps(&_x[0]);
+    __m128 row2 = _mm_load_ps(&_x[4]);
+    __m128 row3 = _mm_load_ps(&_x[8]);
+    __m128 row4 = _mm_load_ps(&_x[12]);
+    _MM_TRANSPOSE4_PS(row1, row2, row3, row4);
+
+    Matrix4 ret;
+    _mm_store_ps(&ret._x[0], row1);
+    _mm_store_ps(&ret._x[4], row2);
+    _mm_store_ps(&ret._x[8], row3);
+    _mm_store_ps(&ret._x[12], row4);
+    return ret;
+}
+
+
+Matrix4 Matrix4::inverse() const {
+    // Block-wise inverse of [A B; C D] with 2x2 blocks, using adjugates so
+    // no block has to be invertible by itself
+    __m128 row1 = _mm_load_ps(&_x[0]);
+    __m128 row2 = _mm_load_ps(&_x[4]);
+    __m128 row3 = _mm_load_ps(&_x[8]);
+    __m128 row4 = _mm_load_ps(&_x[12]);
+    __m128 a = _mm_movelh_ps(row1, row2);
+    __m128 b = _mm_movehl_ps(row2, row1);
+    __m128 c = _mm_movelh_ps(row3, row4);
+    __m128 d = _mm_movehl_ps(row4, row3);
+
+    // Determinants of the four blocks
+    __m128 detSub = _mm_sub_ps(
+        _mm_mul_ps(_mm_shuffle_ps(row1, row3, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(row2, row4, _MM_SHUFFLE(3, 1, 3, 1))),
+        _mm_mul_ps(_mm_shuffle_ps(row1, row3, _MM_SHUFFLE(3, 1, 3, 1)), _mm_shuffle_ps(row2, row4, _MM_SHUFFLE(2, 0, 2, 0))));
+    __m128 detA = splat<0>(detSub);
+    __m128 detB = splat<1>(detSub);
+    __m128 detC = splat<2>(detSub);
+    __m128 detD = splat<3>(detSub);
+
+    __m128 dc = mat2AdjMul(d, c);
+    __m128 ab = mat2AdjMul(a, b);
+    __m128 x = _mm_sub_ps(_mm_mul_ps(detD, a), mat2Mul(b, dc));
+    __m128 w = _mm_sub_ps(_mm_mul_ps(detA, d), mat2Mul(c, ab));
+    __m128 y = _mm_sub_ps(_mm_mul_ps(detB, c), mat2MulAdj(d, ab));
+    __m128 z = _mm_sub_ps(_mm_mul_ps(detC, b), mat2MulAdj(a, dc));
+
+    __m128 det = _mm_add_ps(_mm_mul_ps(detA, detD), _mm_mul_ps(detB, detC));
+    det = _mm_sub_ps(det, sum(_mm_mul_ps(ab, _mm_shuffle_ps(dc, dc, _MM_SHUFFLE(3, 1, 2, 0)))));
+    __m128 rcpDet = _mm_div_ps(_mm_setr_ps(1.0f, -1.0f, -1.0f, 1.0f), det);
+    x = _mm_mul_ps(x, rcpDet);
+    y = _mm_mul_ps(y, rcpDet);
+    z = _mm_mul_ps(z, rcpDet);
+    w = _mm_mul_ps(w, rcpDet);
+
+    Matrix4 ret;
+    _mm_store_ps(&ret._x[0], _mm_shuffle_ps(x, y, _MM_SHUFFLE(1, 3, 1, 3)));
+    _mm_store_ps(&ret._x[4], _mm_shuffle_ps(x, y, _MM_SHUFFLE(0, 2, 0, 2)));
+    _mm_store_ps(&ret._x[8], _mm_shuffle_ps(z, w, _MM_SHUFFLE(1, 3, 1, 3)));
+    _mm_store_ps(&ret._x[12], _mm_shuffle_ps(z, w, _MM_SHUFFLE(0, 2, 0, 2)));
+    return ret;
+}
+
+
+Matrix4 Matrix4::affineInverse() const {
+    // Invert the 3x3 part, then the translation is -inverse * t
+    __m128 c0, c1, c2, det;
+    cofactors(_x, c0, c1, c2, det);
+    __m128 rcpDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+    c0 = _mm_mul_ps(c0, rcpDet);
+    c1 = _mm_mul_ps(c1, rcpDet);
+    c2 = _mm_mul_ps(c2, rcpDet);
+    __m128 c3 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(_x[3])), _mm_mul_ps(c1, _mm_set1_ps(_x[7]))),
+                           _mm_mul_ps(c2, _mm_set1_ps(_x[11])));
+    c3 = _mm_sub_ps(_mm_setr_ps(0.0f, 0.0f, 0.0f, 1.0f), _mm_and_ps(c3, maskXyz()));
+
+    // Those are columns, so transpose into rows. The last row comes out as
+    // 0,0,0,1.
+    _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+    Matrix4 ret;
+    _mm_store_ps(&ret._x[0], c0);
+    _mm_store_ps(&ret._x[4], c1);
+    _mm_store_ps(&ret._x[8], c2);
+    _mm_store_ps(&ret._x[12], c3);
+    return ret;
+}
+
+
+Matrix4 Matrix4::normalMatrix() const {
+    __m128 c0, c1, c2, det;
+    cofactors(_x, c0, c1, c2, det);
+    __m128 rcpDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+    Matrix4 ret;
+    _mm_store_ps(&ret._x[0], _mm_mul_ps(c0, rcpDet));
+    _mm_store_ps(&ret._x[4], _mm_mul_ps(c1, rcpDet));
+    _mm_store_ps(&ret._x[8], _mm_mul_ps(c2, rcpDet));
+    _mm_store_ps(&ret._x[12], _mm_setr_ps(0.0f, 0.0f, 0.0f, 1.0f));
+    return ret;
+}
+
+
+void Matrix4::multiplyBatch(const Matrix4 & lhs, const Matrix4 * rhs, Matrix4 * out, size_t n) {
+    _kernels.multiplyBatch(lhs._x, rhs, out, n);
+}
+
+
+void Matrix4::transformPoints(const Matrix4 & m, const float * x, const float * y, const float * z,
+                              float * outX, float * outY, float * outZ, float * outW, size_t n) {
+    _kernels.transform(m._x, x, y, z, outX, outY, outZ, outW, n, 1.0f);
+}
+
+
+void Matrix4::transformVectors(const Matrix4 & m, const float * x, const float * y, const float * z,
+                               float * outX, float * outY, float * outZ, size_t n) {
+    _kernels.transform(m._x, x, y, z, outX, outY, outZ, nullptr, n, 0.0f);
+}
+
+
+bool Matrix4::setKernel(Kernel kernel) {
+    const Kernels * functions = kernels(kernel);
+    if (!functions) {
+        return false;
+    }
+    _kernels = *functions;
+    _kernel = kernel;
+    _kernelSet = true;
+    return true;
+}
+
+
+const char * Matrix4::kernelName(Kernel kernel) {
+    static const char * names[] = {"sse", "avx2", "avx512"};
+    return names[kernel];
+}
+
+
+Matrix4::Kernel Matrix4::bestKernel() {
+    if (kernels(KERNEL_AVX512)) {
+        return KERNEL_AVX512;
+    }
+    if (kernels(KERNEL_AVX2)) {
+        return KERNEL_AVX2;
+    }
+    return KERNEL_SSE;
+}
+
+
+const Matrix4::Kernels * Matrix4::kernels(Kernel kernel) {
+    static const Kernels sse = {multiplySse, multiplyAffineSse, multiplyBatchSse, transformSse};
+    static const Kernels avx2 = {multiplyAvx2, multiplyAffineAvx2, multiplyBatchAvx2, transformAvx2};
+    static const Kernels avx512 = {multiplyAvx512, multiplyAffineAvx512, multiplyBatchAvx512, transformAvx512};
+
+    // Checks CPUID, and that the OS saves the wider registers
+    __builtin_cpu_init();
+    switch (kernel) {
+    case KERNEL_SSE:
+        return &sse;
+    case KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ? &avx2 : nullptr;
+    case KERNEL_AVX512:
+        return __builtin_cpu_supports("avx512f") ? &avx512 : nullptr;
+    default:
+        return nullptr;
+    }
+}
+
+
+bool Matrix4::upgradeKernel() {
+    if (_kernelSet) {
+        return false;
+    }
+    _kernel = bestKernel();
+    _kernels = *kernels(_kernel);
+    return true;
+}
+
+
+// Every kernel reads all of both inputs before writing, so out may alias
+// either of them
+void Matrix4::multiplySse(const float * lhs, const float * rhs, float * out) {
+    __m128 row1 = _mm_load_ps(&rhs[0]);
+    __m128 row2 = _mm_load_ps(&rhs[4]);
+    __m128 row3 = _mm_load_ps(&rhs[8]);
+    __m128 row4 = _mm_load_ps(&rhs[12]);
+    __m128 rows[4];
+    for (int i=0; i<4; i++) {
+        __m128 brod1 = _mm_set1_ps(lhs[4*i + 0]);
+        __m128 brod2 = _mm_set1_ps(lhs[4*i + 1]);
+        __m128 brod3 = _mm_set1_ps(lhs[4*i + 2]);
+        __m128 brod4 = _mm_set1_ps(lhs[4*i + 3]);
+        rows[i] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(brod1, row1), _mm_mul_ps(brod2, row2)),
+                             _mm_add_ps(_mm_mul_ps(brod3, row3), _mm_mul_ps(brod4, row4)));
+    }
+    for (int i=0; i<4; i++) {
+        _mm_store_ps(&out[4*i], rows[i]);
+    }
+}
+
+
+// As multiplySse when the last row of rhs is 0,0,0,1, so the last column
+// of lhs only lands in the last lane
+void Matrix4::multiplyAffineSse(const float * lhs, const float * rhs, float * out) {
+    __m128 row1 = _mm_load_ps(&rhs[0]);
+    __m128 row2 = _mm_load_ps(&rhs[4]);
+    __m128 row3 = _mm_load_ps(&rhs[8]);
+    __m128 lastLane = _mm_castsi128_ps(_mm_setr_epi32(0, 0, 0, -1));
+    __m128 rows[4];
     for (int i=0; i<4; i++) {
-        __m128 brod1 = _mm_set1_ps(_x[4*i + 0]);
-        __m128 brod2 = _mm_set1_ps(_x[4*i + 1]);
-        __m128 brod3 = _mm_set1_ps(_x[4*i + 2]);
-        __m128 brod4 = _mm_set1_ps(_x[4*i + 3]);
-        __m128 row = _mm_add_ps(_mm_add_ps(_mm_mul_ps(brod1, row1), _mm_mul_ps(brod2, row2)),
-                                _mm_add_ps(_mm_mul_ps(brod3, row3), _mm_mul_ps(brod4, row4)));
-        _mm_store_ps(&_x[4*i], row);
+        __m128 row = _mm_load_ps(&lhs[4*i]);
+        rows[i] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(splat<0>(row), row1), _mm_mul_ps(splat<1>(row), row2)),
+                             _mm_add_ps(_mm_mul_ps(splat<2>(row), row3), _mm_and_ps(row, lastLane)));
+    }
+    for (int i=0; i<4; i++) {
+        _mm_store_ps(&out[4*i], rows[i]);
+    }
+}
+
+
+void Matrix4::multiplyBatchSse(const float * lhs, const Matrix4 * rhs, Matrix4 * out, size_t n) {
+    // The broadcasts of lhs are the same for every matrix
+    __m128 brod[16];
+    for (int i=0; i<16; ++i) {
+        brod[i] = _mm_set1_ps(lhs[i]);
+    }
+    for (size_t j=0; j<n; ++j) {
+        __m128 row1 = _mm_load_ps(&rhs[j]._x[0]);
+        __m128 row2 = _mm_load_ps(&rhs[j]._x[4]);
+        __m128 row3 = _mm_load_ps(&rhs[j]._x[8]);
+        __m128 row4 = _mm_load_ps(&rhs[j]._x[12]);
+        for (int i=0; i<4; i++) {
+            __m128 row = _mm_add_ps(_mm_add_ps(_mm_mul_ps(brod[4*i + 0], row1), _mm_mul_ps(brod[4*i + 1], row2)),
+                                    _mm_add_ps(_mm_mul_ps(brod[4*i + 2], row3), _mm_mul_ps(brod[4*i + 3], row4)));
+            _mm_store_ps(&out[j]._x[4*i], row);
+        }
+    }
+}
+
+
+// Four points per register, the matrix is broadcast once up front
+void Matrix4::transformSse(const float * m, const float * x, const float * y, const float * z,
+                           float * outX, float * outY, float * outZ, float * outW, size_t n, float w) {
+    float * outs[4] = {outX, outY, outZ, outW};
+    int rows = outW ? 4 : 3;
+    __m128 c[4][4];
+    for (int r=0; r<4; ++r) {
+        c[r][0] = _mm_set1_ps(m[4*r + 0]);
+        c[r][1] = _mm_set1_ps(m[4*r + 1]);
+        c[r][2] = _mm_set1_ps(m[4*r + 2]);
+        c[r][3] = _mm_set1_ps(m[4*r + 3] * w);
+    }
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 vx = _mm_loadu_ps(&x[i]);
+        __m128 vy = _mm_loadu_ps(&y[i]);
+        __m128 vz = _mm_loadu_ps(&z[i]);
+        for (int r=0; r<rows; ++r) {
+            __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c[r][0], vx), _mm_mul_ps(c[r][1], vy)),
+                                  _mm_add_ps(_mm_mul_ps(c[r][2], vz), c[r][3]));
+            _mm_storeu_ps(&outs[r][i], v);
+        }
+    }
+    transformScalar(m, x, y, z, outX, outY, outZ, outW, i, n, w);
+}
+
+
+void Matrix4::transformScalar(const float * m, const float * x, const float * y, const float * z,
+                              float * outX, float * outY, float * outZ, float * outW, size_t i, size_t n, float w) {
+    for (; i<n; ++i) {
+        float vx = x[i];
+        float vy = y[i];
+        float vz = z[i];
+        outX[i] = m[0]*vx + m[1]*vy + m[2]*vz + m[3]*w;
+        outY[i] = m[4]*vx + m[5]*vy + m[6]*vz + m[7]*w;
+        outZ[i] = m[8]*vx + m[9]*vy + m[10]*vz + m[11]*w;
+        if (outW) {
+            outW[i] = m[12]*vx + m[13]*vy + m[14]*vz + m[15]*w;
+        }
+    }
+}
+
+
+// Two rows of the result per register. Each column of lhs is spread across
+// its row with a permute, and multiplied into the matching rhs row with an
+// FMA.
+__attribute__((target("avx2,fma")))
+void Matrix4::multiplyAvx2(const float * lhs, const float * rhs, float * out) {
+    __m256 lhs01 = _mm256_loadu_ps(&lhs[0]);
+    __m256 lhs23 = _mm256_loadu_ps(&lhs[8]);
+    __m256 row1 = _mm256_broadcast_ps((const __m128*)&rhs[0]);
+    __m256 row2 = _mm256_broadcast_ps((const __m128*)&rhs[4]);
+    __m256 row3 = _mm256_broadcast_ps((const __m128*)&rhs[8]);
+    __m256 row4 = _mm256_broadcast_ps((const __m128*)&rhs[12]);
+
+    __m256i col1 = _mm256_setr_epi32(0, 0, 0, 0, 4, 4, 4, 4);
+    __m256i col2 = _mm256_setr_epi32(1, 1, 1, 1, 5, 5, 5, 5);
+    __m256i col3 = _mm256_setr_epi32(2, 2, 2, 2, 6, 6, 6, 6);
+    __m256i col4 = _mm256_setr_epi32(3, 3, 3, 3, 7, 7, 7, 7);
+
+    __m256 out01 = _mm256_mul_ps(_mm256_permutevar8x32_ps(lhs01, col1), row1);
+    __m256 out23 = _mm256_mul_ps(_mm256_permutevar8x32_ps(lhs23, col1), row1);
+    out01 = _mm256_fmadd_ps(_mm256_permutevar8x32_ps(lhs01, col2), row2, out01);
+    out23 = _mm256_fmadd_ps(_mm256_permutevar8x32_ps(lhs23, col2), row2, out23);
+    out01 = _mm256_fmadd_ps(_mm256_permutevar8x32_ps(lhs01, col3), row3, out01);
+    out23 = _mm256_fmadd_ps(_mm256_permutevar8x32_ps(lhs23, col3), row3, out23);
+    out01 = _mm256_fmadd_ps(_mm256_permutevar8x32_ps(lhs01, col4), row4, out01);
+    out23 = _mm256_fmadd_ps(_mm256_permutevar8x32_ps(lhs23, col4), row4, out23);
+
+    _mm256_storeu_ps(&out[0], out01);
+    _mm256_storeu_ps(&out[8], out23);
+}
+
+
+__attribute__((target("avx2,fma")))
+void Matrix4::multiplyAffineAvx2(const float * lhs, const float * rhs, float * out) {
+    __m256 lhs01 = _mm256_loadu_ps(&lhs[0]);
+    __m256 lhs23 = _mm256_loadu_ps(&lhs[8]);
+    __m256 row1 = _mm256_broadcast_ps((const __m128*)&rhs[0]);
+    __m256 row2 = _mm256_broadcast_ps((const __m128*)&rhs[4]);
+    __m256 row3 = _mm256_broadcast_ps((const __m128*)&rhs[8]);
+
+    __m256i col1 = _mm256_setr_epi32(0, 0, 0, 0, 4, 4, 4, 4);
+    __m256i col2 = _mm256_setr_epi32(1, 1, 1, 1, 5, 5, 5, 5);
+    __m256i col3 = _mm256_setr_epi32(2, 2, 2, 2, 6, 6, 6, 6);
+    __m256 lastLanes = _mm256_castsi256_ps(_mm256_setr_epi32(0, 0, 0, -1, 0, 0, 0, -1));
+
+    __m256 out01 = _mm256_fmadd_ps(_mm256_permutevar8x32_ps(lhs01, col1), row1, _mm256_and_ps(lhs01, lastLanes));
+    __m256 out23 = _mm256_fmadd_ps(_mm256_permutevar8x32_ps(lhs23, col1), row1, _mm256_and_ps(lhs23, lastLanes));
+    out01 = _mm256_fmadd_ps(_mm256_permutevar8x32_ps(lhs01, col2), row2, out01);
+    out23 = _mm256_fmadd_ps(_mm256_permutevar8x32_ps(lhs23, col2), row2, out23);
+    out01 = _mm256_fmadd_ps(_mm256_permutevar8x32_ps(lhs01, col3), row3, out01);
+    out23 = _mm256_fmadd_ps(_mm256_permutevar8x32_ps(lhs23, col3), row3, out23);
+
+    _mm256_storeu_ps(&out[0], out01);
+    _mm256_storeu_ps(&out[8], out23);
+}
+
+
+__attribute__((target("avx2,fma")))
+void Matrix4::multiplyBatchAvx2(const float * lhs, const Matrix4 * rhs, Matrix4 * out, size_t n) {
+    // The permuted columns of lhs are the same for every matrix
+    __m256 lhs01 = _mm256_loadu_ps(&lhs[0]);
+    __m256 lhs23 = _mm256_loadu_ps(&lhs[8]);
+    __m256 cols01[4];
+    __m256 cols23[4];
+    for (int k=0; k<4; ++k) {
+        __m256i col = _mm256_setr_epi32(k, k, k, k, k + 4, k + 4, k + 4, k + 4);
+        cols01[k] = _mm256_permutevar8x32_ps(lhs01, col);
+        cols23[k] = _mm256_permutevar8x32_ps(lhs23, col);
+    }
+
+    for (size_t j=0; j<n; ++j) {
+        const float * b = rhs[j]._x;
+        __m256 row1 = _mm256_broadcast_ps((const __m128*)&b[0]);
+        __m256 row2 = _mm256_broadcast_ps((const __m128*)&b[4]);
+        __m256 row3 = _mm256_broadcast_ps((const __m128*)&b[8]);
+        __m256 row4 = _mm256_broadcast_ps((const __m128*)&b[12]);
+
+        __m256 out01 = _mm256_mul_ps(cols01[0], row1);
+        __m256 out23 = _mm256_mul_ps(cols23[0], row1);
+        out01 = _mm256_fmadd_ps(cols01[1], row2, out01);
+        out23 = _mm256_fmadd_ps(cols23[1], row2, out23);
+        out01 = _mm256_fmadd_ps(cols01[2], row3, out01);
+        out23 = _mm256_fmadd_ps(cols23[2], row3, out23);
+        out01 = _mm256_fmadd_ps(cols01[3], row4, out01);
+        out23 = _mm256_fmadd_ps(cols23[3], row4, out23);
+
+        _mm256_storeu_ps(&out[j]._x[0], out01);
+        _mm256_storeu_ps(&out[j]._x[8], out23);
+    }
+}
+
+
+__attribute__((target("avx2,fma")))
+void Matrix4::transformAvx2(const float * m, const float * x, const float * y, const float * z,
+                            float * outX, float * outY, float * outZ, float * outW, size_t n, float w) {
+    float * outs[4] = {outX, outY, outZ, outW};
+    int rows = outW ? 4 : 3;
+    __m256 c[4][4];
+    for (int r=0; r<4; ++r) {
+        c[r][0] = _mm256_set1_ps(m[4*r + 0]);
+        c[r][1] = _mm256_set1_ps(m[4*r + 1]);
+        c[r][2] = _mm256_set1_ps(m[4*r + 2]);
+        c[r][3] = _mm256_set1_ps(m[4*r + 3] * w);
+    }
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 vx = _mm256_loadu_ps(&x[i]);
+        __m256 vy = _mm256_loadu_ps(&y[i]);
+        __m256 vz = _mm256_loadu_ps(&z[i]);
+        for (int r=0; r<rows; ++r) {
+            __m256 v = _mm256_fmadd_ps(c[r][0], vx, _mm256_fmadd_ps(c[r][1], vy, _mm256_fmadd_ps(c[r][2], vz, c[r][3])));
+            _mm256_storeu_ps(&outs[r][i], v);
+        }
+    }
+    transformScalar(m, x, y, z, outX, outY, outZ, outW, i, n, w);
+}
+
+
+// The whole matrix in one register, four FMAs. The masked forms avoid
+// spurious uninitialised warnings from some GCC versions.
+__attribute__((target("avx512f")))
+void Matrix4::multiplyAvx512(const float * lhs, const float * rhs, float * out) {
+    __m512 a = _mm512_loadu_ps(lhs);
+    __m512 b = _mm512_loadu_ps(rhs);
+
+    __m512i col1 = _mm512_setr_epi32(0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12);
+    __m512i col2 = _mm512_add_epi32(col1, _mm512_set1_epi32(1));
+    __m512i col3 = _mm512_add_epi32(col1, _mm512_set1_epi32(2));
+    __m512i col4 = _mm512_add_epi32(col1, _mm512_set1_epi32(3));
+
+    __m512 ret = _mm512_mul_ps(_mm512_mask_permutexvar_ps(a, 0xffff, col1, a), _mm512_mask_shuffle_f32x4(b, 0xffff, b, b, 0x00));
+    ret = _mm512_fmadd_ps(_mm512_mask_permutexvar_ps(a, 0xffff, col2, a), _mm512_mask_shuffle_f32x4(b, 0xffff, b, b, 0x55), ret);
+    ret = _mm512_fmadd_ps(_mm512_mask_permutexvar_ps(a, 0xffff, col3, a), _mm512_mask_shuffle_f32x4(b, 0xffff, b, b, 0xaa), ret);
+    ret = _mm512_fmadd_ps(_mm512_mask_permutexvar_ps(a, 0xffff, col4, a), _mm512_mask_shuffle_f32x4(b, 0xffff, b, b, 0xff), ret);
+    _mm512_storeu_ps(out, ret);
+}
+
+
+__attribute__((target("avx512f")))
+void Matrix4::multiplyAffineAvx512(const float * lhs, const float * rhs, float * out) {
+    __m512 a = _mm512_loadu_ps(lhs);
+    __m512 b = _mm512_loadu_ps(rhs);
+
+    __m512i col1 = _mm512_setr_epi32(0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12);
+    __m512i col2 = _mm512_add_epi32(col1, _mm512_set1_epi32(1));
+    __m512i col3 = _mm512_add_epi32(col1, _mm512_set1_epi32(2));
+
+    __m512 ret = _mm512_maskz_mov_ps(0x8888, a);
+    ret = _mm512_fmadd_ps(_mm512_mask_permutexvar_ps(a, 0xffff, col1, a), _mm512_mask_shuffle_f32x4(b, 0xffff, b, b, 0x00), ret);
+    ret = _mm512_fmadd_ps(_mm512_mask_permutexvar_ps(a, 0xffff, col2, a), _mm512_mask_shuffle_f32x4(b, 0xffff, b, b, 0x55), ret);
+    ret = _mm512_fmadd_ps(_mm512_mask_permutexvar_ps(a, 0xffff, col3, a), _mm512_mask_shuffle_f32x4(b, 0xffff, b, b, 0xaa), ret);
+    _mm512_storeu_ps(out, ret);
+}
+
+
+__attribute__((target("avx512f")))
+void Matrix4::multiplyBatchAvx512(const float * lhs, const Matrix4 * rhs, Matrix4 * out, size_t n) {
+    // The permuted columns of lhs are the same for every matrix
+    __m512 a = _mm512_loadu_ps(lhs);
+    __m512i col1 = _mm512_setr_epi32(0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12);
+    __m512 cols[4];
+    for (int k=0; k<4; ++k) {
+        cols[k] = _mm512_mask_permutexvar_ps(a, 0xffff, _mm512_add_epi32(col1, _mm512_set1_epi32(k)), a);
     }
+
+    for (size_t j=0; j<n; ++j) {
+        __m512 b = _mm512_loadu_ps(rhs[j]._x);
+        __m512 ret = _mm512_mul_ps(cols[0], _mm512_mask_shuffle_f32x4(b, 0xffff, b, b, 0x00));
+        ret = _mm512_fmadd_ps(cols[1], _mm512_mask_shuffle_f32x4(b, 0xffff, b, b, 0x55), ret);
+        ret = _mm512_fmadd_ps(cols[2], _mm512_mask_shuffle_f32x4(b, 0xffff, b, b, 0xaa), ret);
+        ret = _mm512_fmadd_ps(cols[3], _mm512_mask_shuffle_f32x4(b, 0xffff, b, b, 0xff), ret);
+        _mm512_storeu_ps(out[j]._x, ret);
+    }
+}
+
+
+__attribute__((target("avx512f")))
+void Matrix4::transformAvx512(const float * m, const float * x, const float * y, const float * z,
+                              float * outX, float * outY, float * outZ, float * outW, size_t n, float w) {
+    float * outs[4] = {outX, outY, outZ, outW};
+    int rows = outW ? 4 : 3;
+    __m512 c[4][4];
+    for (int r=0; r<4; ++r) {
+        c[r][0] = _mm512_set1_ps(m[4*r + 0]);
+        c[r][1] = _mm512_set1_ps(m[4*r + 1]);
+        c[r][2] = _mm512_set1_ps(m[4*r + 2]);
+        c[r][3] = _mm512_set1_ps(m[4*r + 3] * w);
+    }
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 vx = _mm512_loadu_ps(&x[i]);
+        __m512 vy = _mm512_loadu_ps(&y[i]);
+        __m512 vz = _mm512_loadu_ps(&z[i]);
+        for (int r=0; r<rows; ++r) {
+            __m512 v = _mm512_fmadd_ps(c[r][0], vx, _mm512_fmadd_ps(c[r][1], vy, _mm512_fmadd_ps(c[r][2], vz, c[r][3])));
+            _mm512_storeu_ps(&outs[r][i], v);
+        }
+    }
+    transformScalar(m, x, y, z, outX, outY, outZ, outW, i, n, w);
+}
+
+
+AffineMatrix4 AffineMatrix4::operator*(const AffineMatrix4 & rhs) const {
+    // The last row comes out as 0,0,0,1 again
+    AffineMatrix4 ret;
+    _kernels.multiplyAffine(_x, rhs._x, ret._x);
+    return ret;
+}
+
+
+AffineMatrix4 & AffineMatrix4::operator*=(const AffineMatrix4 & rhs) {
+    _kernels.multiplyAffine(_x, rhs._x, _x);
     return *this;
 }
 
 
+Matrix4 AffineMatrix4::operator*(const Matrix4 & rhs) const {
+    return Matrix4::operator*(rhs);
+}
+
+
+AffineMatrix4 AffineMatrix4::inverse() const {
+    return AffineMatrix4(affineInverse());
+}
+
+
 std::ostream & operator<<(std::ostream & os, const Matrix4 & rhs) {
     os << "{\n";
     for (int i=0; i<4; ++i) {
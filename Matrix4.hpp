@@ -2,28 +2,135 @@
 #define Matrix4_hpp
 
 
+#include <cstddef>
 #include <iosfwd>
 
 
+class AffineMatrix4;
+
+
 class Matrix4 {
 public:
+    // Implementations of the multiplies and transforms, the best one the
+    // CPU supports is picked at startup
+    enum Kernel {
+        KERNEL_SSE,
+        KERNEL_AVX2,       // with FMA
+        KERNEL_AVX512,
+    };
+
     static Matrix4 createProjectionMatrix(float fieldOfView, float aspectRatio, float nearPlane, float farPlane);
-    static Matrix4 createViewMatrix(float cameraX, float cameraY, float cameraZ, float cameraPitch, float cameraYaw);
-    static Matrix4 createTranslationMatrix(float x, float y, float z);
-    static Matrix4 createRotationMatrix(float pitch, float yaw);
+    static AffineMatrix4 createViewMatrix(float cameraX, float cameraY, float cameraZ, float cameraPitch, float cameraYaw);
+    static AffineMatrix4 createTranslationMatrix(float x, float y, float z);
+    static AffineMatrix4 createScaleMatrix(float x, float y, float z);
+    static AffineMatrix4 createRotationMatrix(float pitch, float yaw);
 
     Matrix4 operator*(const Matrix4 & rhs) const;
     Matrix4 & operator*=(const Matrix4 & rhs);
 
+    // Skips the known last row of rhs
+    Matrix4 operator*(const AffineMatrix4 & rhs) const;
+    Matrix4 & operator*=(const AffineMatrix4 & rhs);
+
+    Matrix4 transpose() const;
+
+    // The result is undefined if the matrix is singular
+    Matrix4 inverse() const;
+
+    // Cheaper inverse for when the last row is 0,0,0,1
+    Matrix4 affineInverse() const;
+
+    // Inverse transpose of the upper 3x3, for transforming normals
+    Matrix4 normalMatrix() const;
+
     const float * data() const { return _x; }
 
+    // out[i] = lhs * rhs[i]. Every element is independent, so a large batch
+    // can be split into ranges and run on several threads. out may be rhs.
+    static void multiplyBatch(const Matrix4 & lhs, const Matrix4 * rhs, Matrix4 * out, size_t n);
+
+    // Transforms n points held as separate x, y and z arrays, with w taken
+    // as 1. outW may be nullptr when m is affine. The outputs may be the
+    // inputs, and like multiplyBatch the range can be split across threads.
+    static void transformPoints(const Matrix4 & m, const float * x, const float * y, const float * z,
+                                float * outX, float * outY, float * outZ, float * outW, size_t n);
+
+    // As transformPoints but with w taken as 0, so there is no translation
+    static void transformVectors(const Matrix4 & m, const float * x, const float * y, const float * z,
+                                 float * outX, float * outY, float * outZ, size_t n);
+
+    // Returns false if the CPU does not support kernel. Not thread safe.
+    static bool setKernel(Kernel kernel);
+    static Kernel kernel() { return _kernel; }
+    static Kernel bestKernel();
+    static const char * kernelName(Kernel kernel);
+
 private:
+    struct Kernels {
+        void (*multiply)(const float * lhs, const float * rhs, float * out);
+        void (*multiplyAffine)(const float * lhs, const float * rhs, float * out);
+        void (*multiplyBatch)(const float * lhs, const Matrix4 * rhs, Matrix4 * out, size_t n);
+        void (*transform)(const float * m, const float * x, const float * y, const float * z,
+                          float * outX, float * outY, float * outZ, float * outW, size_t n, float w);
+    };
+
+    static const Kernels * kernels(Kernel kernel);
+    static bool upgradeKernel();
+
+    static void multiplySse(const float * lhs, const float * rhs, float * out);
+    static void multiplyAffineSse(const float * lhs, const float * rhs, float * out);
+    static void multiplyBatchSse(const float * lhs, const Matrix4 * rhs, Matrix4 * out, size_t n);
+    static void transformSse(const float * m, const float * x, const float * y, const float * z,
+                             float * outX, float * outY, float * outZ, float * outW, size_t n, float w);
+    static void multiplyAvx2(const float * lhs, const float * rhs, float * out);
+    static void multiplyAffineAvx2(const float * lhs, const float * rhs, float * out);
+    static void multiplyBatchAvx2(const float * lhs, const Matrix4 * rhs, Matrix4 * out, size_t n);
+    static void transformAvx2(const float * m, const float * x, const float * y, const float * z,
+                              float * outX, float * outY, float * outZ, float * outW, size_t n, float w);
+    static void multiplyAvx512(const float * lhs, const float * rhs, float * out);
+    static void multiplyAffineAvx512(const float * lhs, const float * rhs, float * out);
+    static void multiplyBatchAvx512(const float * lhs, const Matrix4 * rhs, Matrix4 * out, size_t n);
+    static void transformAvx512(const float * m, const float * x, const float * y, const float * z,
+                                float * outX, float * outY, float * outZ, float * outW, size_t n, float w);
+    static void transformScalar(const float * m, const float * x, const float * y, const float * z,
+                                float * outX, float * outY, float * outZ, float * outW, size_t i, size_t n, float w);
+
+    // Constant initialised to SSE, so matrices work during static
+    // initialisation, then upgraded to the best kernel once Matrix4.cpp's
+    // initialisers run unless setKernel has been called by then
+    static Kernel _kernel;
+    static Kernels _kernels;
+    static bool _kernelSet;
+    static bool _kernelUpgraded;
+
+    friend class AffineMatrix4;
     friend std::ostream & operator<<(std::ostream & os, const Matrix4 & rhs);
 
     float _x[16]; // row-major
 } __attribute__((aligned(16)));
 
 
+// A Matrix4 whose last row is known to be 0,0,0,1, such as any combination
+// of rotations, scales and translations. Products pick the cheaper affine
+// paths at compile time.
+class AffineMatrix4 : public Matrix4 {
+public:
+    AffineMatrix4() {
+    }
+
+    // The caller guarantees the last row of m is 0,0,0,1
+    explicit AffineMatrix4(const Matrix4 & m) :
+        Matrix4(m) {
+    }
+
+    AffineMatrix4 operator*(const AffineMatrix4 & rhs) const;
+    AffineMatrix4 & operator*=(const AffineMatrix4 & rhs);
+    Matrix4 operator*(const Matrix4 & rhs) const;
+
+    AffineMatrix4 inverse() const;
+};
+
+
 std::ostream & operator<<(std::ostream & os, const Matrix4 & rhs);
 
 
@@ -0,0 +1,313 @@
+#ifndef MeshRegistry_hpp
+#define MeshRegistry_hpp
+
+#include <GL/glew.h>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "ConcurrentAllocator.hpp"
+#include "TypedBufferAllocator.hpp"
+
+
+// Meshes packed into shared, paged vertex and index buffers, so that any
+// number of them can be drawn from one VAO per pair of pages. Each mesh
+// knows where it lives, which stays correct as the buffers are compacted,
+// and has a bounding sphere kept split by component for culling.
+//
+// Meshes of fewer than 65535 vertices get 16 bit indices and the rest 32
+// bit ones, each in their own buffers. The all ones index of either width
+// is left free for primitive restart.
+template<typename Vertex>
+class MeshRegistry {
+public:
+    typedef unsigned Id;
+
+    class Mesh {
+    public:
+        int baseVertex() const {
+            return *_vertices;
+        }
+
+        unsigned firstIndex() const {
+            return _wide ? *_wideIndices : *_indices;
+        }
+
+        unsigned indexCount() const {
+            return _wide ? _wideIndices.count() : _indices.count();
+        }
+
+        // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+        unsigned indexType() const {
+            return _wide ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+        }
+
+        bool wideIndices() const {
+            return _wide;
+        }
+
+        unsigned vertexPage() const {
+            return _vertices.page();
+        }
+
+        unsigned indexPage() const {
+            return _wide ? _wideIndices.page() : _indices.page();
+        }
+
+    private:
+        typename TypedBufferAllocator<Vertex>::Ref _vertices;
+        TypedBufferAllocator<uint16_t>::Ref _indices;
+        TypedBufferAllocator<uint32_t>::Ref _wideIndices;
+        bool _wide;
+        friend class MeshRegistry;
+    };
+
+    MeshRegistry() {
+    }
+
+    MeshRegistry(unsigned pageSz, unsigned usage, StagingRing * staging) :
+        _vertexBuffer(pageSz, GL_ARRAY_BUFFER, usage, staging, true),
+        _indexBuffer(pageSz, GL_ARRAY_BUFFER, usage, staging, true),
+        _wideIndexBuffer(pageSz, GL_ARRAY_BUFFER, usage, staging, true) {
+    }
+
+    // A mesh to add. Indices are relative to its first vertex. The bounding
+    // sphere is the caller's, as Vertex may be packed.
+    struct Source {
+        const Vertex *   vertices;
+        unsigned         vertexCount;
+        const uint32_t * indices;
+        unsigned         indexCount;
+        const float *    centre;
+        float            radius;
+    };
+
+    Id add(const Vertex * vertices, unsigned vertexCount, const uint32_t * indices, unsigned indexCount,
+           const float * centre, float radius) {
+        Source source = {vertices, vertexCount, indices, indexCount, centre, radius};
+        return addBatch(&source, 1);
+    }
+
+    // Adds the meshes with one upload into each buffer, see
+    // BufferAllocator::allocateBatch. Returns the first one's id, and the
+    // rest follow in order.
+    Id addBatch(const Source * sources, unsigned count) {
+        // Narrow all the small meshes' indices first, so the uploads can
+        // point into _narrowed without it moving
+        unsigned narrowedCount = 0;
+        for (unsigned i=0; i<count; ++i) {
+            narrowedCount += wide(sources[i]) ? 0 : sources[i].indexCount;
+        }
+        _narrowed.resize(narrowedCount);
+
+        std::vector<typename TypedBufferAllocator<Vertex>::Upload> vertexUploads;
+        std::vector<TypedBufferAllocator<uint16_t>::Upload> indexUploads;
+        std::vector<TypedBufferAllocator<uint32_t>::Upload> wideIndexUploads;
+        uint16_t * narrowed = _narrowed.data();
+        for (unsigned i=0; i<count; ++i) {
+            const Source & source = sources[i];
+            vertexUploads.push_back({source.vertices, source.vertexCount});
+            if (wide(source)) {
+                wideIndexUploads.push_back({source.indices, source.indexCount});
+            } else {
+                std::copy(source.indices, source.indices + source.indexCount, narrowed);
+                indexUploads.push_back({narrowed, source.indexCount});
+                narrowed += source.indexCount;
+            }
+        }
+        std::vector<typename TypedBufferAllocator<Vertex>::Ref> vertices =
+            _vertexBuffer.allocateBatch(vertexUploads.data(), vertexUploads.size());
+        std::vector<TypedBufferAllocator<uint16_t>::Ref> indices =
+            _indexBuffer.allocateBatch(indexUploads.data(), indexUploads.size());
+        std::vector<TypedBufferAllocator<uint32_t>::Ref> wideIndices =
+            _wideIndexBuffer.allocateBatch(wideIndexUploads.data(), wideIndexUploads.size());
+
+        Id first = _meshes.size();
+        unsigned nextIndices = 0;
+        unsigned nextWideIndices = 0;
+        for (unsigned i=0; i<count; ++i) {
+            const Source & source = sources[i];
+            Mesh mesh;
+            mesh._vertices = vertices[i];
+            mesh._wide = wide(source);
+            if (mesh._wide) {
+                mesh._wideIndices = wideIndices[nextWideIndices++];
+            } else {
+                mesh._indices = indices[nextIndices++];
+            }
+            push(mesh, source.centre, source.radius);
+        }
+        return first;
+    }
+
+    // Adds meshes from worker threads through a ConcurrentAllocator per
+    // buffer. Make one on the render thread for count meshes, and give each
+    // worker an Arena to add its share through. Call flush() until they are
+    // all done, then finish() registers the meshes.
+    class Loader {
+    public:
+        class Arena {
+        public:
+            explicit Arena(Loader & loader) :
+                _loader(loader),
+                _vertices(loader._vertices),
+                _indices(loader._indices),
+                _wideIndices(loader._wideIndices) {
+            }
+
+            // The source is copied. Every slot below the loader's count must
+            // be added once, and its data must fit in a chunk.
+            void add(const Source & source, unsigned slot) {
+                Pending & pending = _loader._pending[slot];
+                pending.wide = wide(source);
+                std::copy(source.centre, source.centre + 3, pending.centre);
+                pending.radius = source.radius;
+                _vertices.allocate(source.vertices, TypedBufferAllocator<Vertex>::bytes(source.vertexCount), &pending.vertices);
+                if (pending.wide) {
+                    _wideIndices.allocate(source.indices, TypedBufferAllocator<uint32_t>::bytes(source.indexCount), &pending.indices);
+                } else {
+                    _narrowed.assign(source.indices, source.indices + source.indexCount);
+                    _indices.allocate(_narrowed.data(), TypedBufferAllocator<uint16_t>::bytes(source.indexCount), &pending.indices);
+                }
+            }
+
+        private:
+            Loader & _loader;
+            ConcurrentAllocator::Arena _vertices;
+            ConcurrentAllocator::Arena _indices;
+            ConcurrentAllocator::Arena _wideIndices;
+            std::vector<uint16_t> _narrowed;
+        };
+
+        Loader(MeshRegistry & registry, unsigned count, unsigned chunkSz) :
+            _registry(registry),
+            _pending(count),
+            _vertices(registry._vertexBuffer.allocator(), chunkSz / sizeof(Vertex) * sizeof(Vertex), sizeof(Vertex)),
+            _indices(registry._indexBuffer.allocator(), chunkSz / sizeof(uint16_t) * sizeof(uint16_t), sizeof(uint16_t)),
+            _wideIndices(registry._wideIndexBuffer.allocator(), chunkSz / sizeof(uint32_t) * sizeof(uint32_t), sizeof(uint32_t)) {
+        }
+
+        void flush() {
+            _vertices.flush();
+            _indices.flush();
+            _wideIndices.flush();
+        }
+
+        // Once the arenas are gone. Returns the first mesh's id, and the rest
+        // follow in slot order.
+        Id finish() {
+            flush();
+            Id first = _registry._meshes.size();
+            for (const Pending & pending : _pending) {
+                Mesh mesh;
+                mesh._vertices = typename TypedBufferAllocator<Vertex>::Ref(pending.vertices);
+                mesh._wide = pending.wide;
+                if (mesh._wide) {
+                    mesh._wideIndices = TypedBufferAllocator<uint32_t>::Ref(pending.indices);
+                } else {
+                    mesh._indices = TypedBufferAllocator<uint16_t>::Ref(pending.indices);
+                }
+                _registry.push(mesh, pending.centre, pending.radius);
+            }
+            _pending.clear();
+            return first;
+        }
+
+    private:
+        // Filled in by the arenas and the flushes
+        struct Pending {
+            BufferAllocator::Ref vertices;
+            BufferAllocator::Ref indices;
+            bool  wide;
+            float centre[3];
+            float radius;
+        };
+
+        // The allocators fill in _pending as they go, so they go first
+        MeshRegistry & _registry;
+        std::vector<Pending> _pending;
+        ConcurrentAllocator _vertices;
+        ConcurrentAllocator _indices;
+        ConcurrentAllocator _wideIndices;
+    };
+
+    const Mesh & operator[](Id id) const {
+        return _meshes[id];
+    }
+
+    unsigned size() const {
+        return _meshes.size();
+    }
+
+    const float * boundsX() const {
+        return _boundsX.data();
+    }
+
+    const float * boundsY() const {
+        return _boundsY.data();
+    }
+
+    const float * boundsZ() const {
+        return _boundsZ.data();
+    }
+
+    const float * boundsRadius() const {
+        return _boundsRadius.data();
+    }
+
+    TypedBufferAllocator<Vertex> & vertexBuffer() {
+        return _vertexBuffer;
+    }
+
+    const TypedBufferAllocator<Vertex> & vertexBuffer() const {
+        return _vertexBuffer;
+    }
+
+    TypedBufferAllocator<uint16_t> & indexBuffer() {
+        return _indexBuffer;
+    }
+
+    const TypedBufferAllocator<uint16_t> & indexBuffer() const {
+        return _indexBuffer;
+    }
+
+    TypedBufferAllocator<uint32_t> & wideIndexBuffer() {
+        return _wideIndexBuffer;
+    }
+
+    const TypedBufferAllocator<uint32_t> & wideIndexBuffer() const {
+        return _wideIndexBuffer;
+    }
+
+    // The element buffer holding a mesh's indices
+    unsigned indexBufferOf(const Mesh & mesh) const {
+        return mesh._wide ? _wideIndexBuffer.buffer(mesh.indexPage()) : _indexBuffer.buffer(mesh.indexPage());
+    }
+
+private:
+    static bool wide(const Source & source) {
+        return source.vertexCount >= 0xffff;
+    }
+
+    void push(const Mesh & mesh, const float * centre, float radius) {
+        _meshes.push_back(mesh);
+        _boundsX.push_back(centre[0]);
+        _boundsY.push_back(centre[1]);
+        _boundsZ.push_back(centre[2]);
+        _boundsRadius.push_back(radius);
+    }
+
+    TypedBufferAllocator<Vertex> _vertexBuffer;
+    TypedBufferAllocator<uint16_t> _indexBuffer;
+    TypedBufferAllocator<uint32_t> _wideIndexBuffer;
+    std::vector<Mesh>   _meshes;
+    std::vector<uint16_t> _narrowed;
+
+    std::vector<float>  _boundsX;
+    std::vector<float>  _boundsY;
+    std::vector<float>  _boundsZ;
+    std::vector<float>  _boundsRadius;
+};
+
+
+#endif
@@ -0,0 +1,105 @@
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "PackedMesh.hpp"
+
+
+namespace {
+
+
+// Rounds [-1, 1] to the nearest normalised integer of the given maximum
+int normalise(float value, int max) {
+    value = std::min(std::max(value, -1.0f), 1.0f);
+    return int(lroundf(value * float(max)));
+}
+
+
+}
+
+
+PackedMesh::PackedMesh(const float * positions, const float * normals, unsigned count, const Quantisation & quantisation) :
+    _vertices(count),
+    _centre(),
+    _radius(0.0f) {
+    if (!count) {
+        return;
+    }
+
+    // Bound the mesh for culling, and check it fits the box
+    float lo[3] = {positions[0], positions[1], positions[2]};
+    float hi[3] = {positions[0], positions[1], positions[2]};
+    for (unsigned i=1; i<count; ++i) {
+        for (int axis=0; axis<3; ++axis) {
+            lo[axis] = std::min(lo[axis], positions[i*3 + axis]);
+            hi[axis] = std::max(hi[axis], positions[i*3 + axis]);
+        }
+    }
+    for (int axis=0; axis<3; ++axis) {
+        if (lo[axis] < quantisation.offset[axis] - quantisation.scale[axis] ||
+            hi[axis] > quantisation.offset[axis] + quantisation.scale[axis]) {
+            throw std::runtime_error("Mesh lies outside the quantisation box");
+        }
+        _centre[axis] = (lo[axis] + hi[axis]) * 0.5f;
+    }
+
+    for (unsigned i=0; i<count; ++i) {
+        const float * position = positions + i*3;
+        int16_t packed[3];
+        float distanceSq = 0.0f;
+        for (int axis=0; axis<3; ++axis) {
+            packed[axis] = normalise((position[axis] - quantisation.offset[axis]) / quantisation.scale[axis], 32767);
+            float centred = position[axis] - _centre[axis];
+            distanceSq += centred * centred;
+        }
+        _radius = std::max(_radius, distanceSq);
+        _vertices[i].x = packed[0];
+        _vertices[i].y = packed[1];
+        _vertices[i].z = packed[2];
+
+        float encoded[2] = {0.0f, 0.0f};
+        if (normals) {
+            encodeOctahedral(normals + i*3, encoded);
+        }
+        _vertices[i].normal[0] = normalise(encoded[0], 127);
+        _vertices[i].normal[1] = normalise(encoded[1], 127);
+    }
+
+    // Quantising moves positions by up to half a step, so pad for that
+    float step = std::max(std::max(quantisation.scale[0], quantisation.scale[1]), quantisation.scale[2]) / 32767.0f;
+    _radius = sqrtf(_radius) + step;
+}
+
+
+void PackedMesh::encodeOctahedral(const float * normal, float * encoded) {
+    // Project onto the octahedron, then fold the lower half over the upper
+    float sum = fabsf(normal[0]) + fabsf(normal[1]) + fabsf(normal[2]);
+    float x = sum > 0.0f ? normal[0] / sum : 0.0f;
+    float y = sum > 0.0f ? normal[1] / sum : 0.0f;
+    if (normal[2] < 0.0f) {
+        float foldedX = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float foldedY = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = foldedX;
+        y = foldedY;
+    }
+    encoded[0] = x;
+    encoded[1] = y;
+}
+
+
+void PackedMesh::decodeOctahedral(const float * encoded, float * normal) {
+    float x = encoded[0];
+    float y = encoded[1];
+    float z = 1.0f - fabsf(x) - fabsf(y);
+    if (z < 0.0f) {
+        float unfoldedX = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float unfoldedY = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = unfoldedX;
+        y = unfoldedY;
+    }
+    float length = sqrtf(x*x + y*y + z*z);
+    normal[0] = x / length;
+    normal[1] = y / length;
+    normal[2] = z / length;
+}
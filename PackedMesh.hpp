@@ -0,0 +1,56 @@
+#ifndef PackedMesh_hpp
+#define PackedMesh_hpp
+
+#include <cstdint>
+#include <vector>
+
+
+// A mesh packed into 8 byte vertices for upload: positions as normalised
+// shorts across a box shared by every mesh, and unit normals octahedral
+// encoded into two normalised bytes. The shader gets a position back as
+// offset + scale * the normalised position, with no per mesh state, so
+// meshes in the same buffers can still go out in one multi draw.
+class PackedMesh {
+public:
+    struct Vertex {
+        int16_t x, y, z;
+        int8_t  normal[2];
+    };
+
+    // The box positions are quantised across, as its centre and half extent
+    struct Quantisation {
+        float offset[3];
+        float scale[3];
+    };
+
+    // Positions and normals are xyz triples, and normals may be null, which
+    // leaves them all facing +z. Throws if a position is outside the box.
+    PackedMesh(const float * positions, const float * normals, unsigned count, const Quantisation & quantisation);
+
+    // Packs a unit vector into two components in [-1, 1]
+    static void encodeOctahedral(const float * normal, float * encoded);
+
+    // The inverse, as the shader does it
+    static void decodeOctahedral(const float * encoded, float * normal);
+
+    const std::vector<Vertex> & vertices() const {
+        return _vertices;
+    }
+
+    // A sphere around the centre of the bounding box
+    const float * centre() const {
+        return _centre;
+    }
+
+    float radius() const {
+        return _radius;
+    }
+
+private:
+    std::vector<Vertex> _vertices;
+    float _centre[3];
+    float _radius;
+};
+
+
+#endif
@@ -0,0 +1,205 @@
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <algorithm>
+#include <ostream>
+#include <stdexcept>
+
+#include "Profiler.hpp"
+
+
+namespace {
+
+
+double milliseconds(Profiler::Clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+
+// Sections can be timed more than once a frame, negative means no samples
+void accumulate(float & sample, double value) {
+    sample = sample < 0.0f ? float(value) : sample + float(value);
+}
+
+
+}
+
+
+Profiler::CpuScope::CpuScope(Profiler & profiler, unsigned section) :
+    _profiler(profiler),
+    _section(section),
+    _start(Clock::now()) {
+}
+
+
+Profiler::CpuScope::~CpuScope() {
+    Frame & frame = _profiler._frames[_profiler._frame % HISTORY];
+    accumulate(frame.cpu[_section], milliseconds(Clock::now() - _start));
+}
+
+
+Profiler::GpuScope::GpuScope(Profiler & profiler, unsigned section) :
+    _profiler(profiler) {
+    std::vector<Query> & queries = profiler._queries[profiler._frame % QUERY_LATENCY];
+    if (profiler._queryCount == queries.size()) {
+        Query query = {0, 0, 0, false};
+        glGenQueries(1, &query.query);
+        queries.push_back(query);
+    }
+
+    // If the GPU is more than QUERY_LATENCY frames behind the old result is
+    // dropped rather than waited for
+    Query & query = queries[profiler._queryCount++];
+    query.section = section;
+    query.frame = profiler._frame;
+    query.pending = true;
+    glBeginQuery(GL_TIME_ELAPSED, query.query);
+}
+
+
+Profiler::GpuScope::~GpuScope() {
+    glEndQuery(GL_TIME_ELAPSED);
+}
+
+
+Profiler::Profiler() :
+    _frames(HISTORY),
+    _queryCount(0),
+    _frame(0) {
+}
+
+
+Profiler::~Profiler() {
+    for (std::vector<Query> & queries : _queries) {
+        for (Query & query : queries) {
+            glDeleteQueries(1, &query.query);
+        }
+    }
+}
+
+
+unsigned Profiler::section(const char * name) {
+    for (unsigned i=0; i<_sections.size(); ++i) {
+        if (_sections[i] == name) {
+            return i;
+        }
+    }
+    if (_sections.size() == MAX_SECTIONS) {
+        throw std::runtime_error("Too many profiler sections");
+    }
+    _sections.push_back(name);
+    return _sections.size() - 1;
+}
+
+
+void Profiler::beginFrame() {
+    collect();
+
+    Frame & frame = _frames[_frame % HISTORY];
+    frame.total = -1.0f;
+    std::fill(frame.cpu, frame.cpu + MAX_SECTIONS, -1.0f);
+    std::fill(frame.gpu, frame.gpu + MAX_SECTIONS, -1.0f);
+    std::fill(frame.count, frame.count + MAX_SECTIONS, -1.0f);
+    _queryCount = 0;
+    _frameStart = Clock::now();
+}
+
+
+void Profiler::endFrame() {
+    _frames[_frame % HISTORY].total = float(milliseconds(Clock::now() - _frameStart));
+    ++_frame;
+}
+
+
+void Profiler::count(unsigned section, double value) {
+    accumulate(_frames[_frame % HISTORY].count[section], value);
+}
+
+
+double Profiler::percentile(double p, unsigned section, Source source) const {
+    std::vector<float> samples;
+    values(section, source, samples);
+    if (samples.empty()) {
+        return 0.0;
+    }
+    std::vector<float>::iterator nth = samples.begin() + size_t(p * (samples.size() - 1));
+    std::nth_element(samples.begin(), nth, samples.end());
+    return *nth;
+}
+
+
+void Profiler::writeSummaryCsv(std::ostream & os) const {
+    os << "section,source,samples,mean,p50,p95,p99,max\n";
+    std::vector<float> samples;
+    auto row = [&](const std::string & name, const char * source) {
+        if (samples.empty()) {
+            return;
+        }
+        std::sort(samples.begin(), samples.end());
+        double sum = 0.0;
+        for (float sample : samples) {
+            sum += sample;
+        }
+        auto at = [&](double p) {
+            return samples[size_t(p * (samples.size() - 1))];
+        };
+        os << name << ',' << source << ',' << samples.size() << ',' << sum / samples.size() << ','
+           << at(0.5) << ',' << at(0.95) << ',' << at(0.99) << ',' << samples.back() << '\n';
+    };
+
+    static const char * const sources[] = {"cpu", "gpu", "count"};
+    values(~0u, SOURCE_CPU, samples);
+    row("frame", sources[SOURCE_CPU]);
+    for (unsigned i=0; i<_sections.size(); ++i) {
+        for (int source=SOURCE_CPU; source<=SOURCE_COUNT; ++source) {
+            values(i, Source(source), samples);
+            row(_sections[i], sources[source]);
+        }
+    }
+}
+
+
+void Profiler::collect() {
+    // Pick up whichever GPU timings have landed, without waiting
+    for (std::vector<Query> & queries : _queries) {
+        for (Query & query : queries) {
+            if (!query.pending) {
+                continue;
+            }
+            GLint available = 0;
+            glGetQueryObjectiv(query.query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) {
+                continue;
+            }
+            GLuint64 ns = 0;
+            glGetQueryObjectui64v(query.query, GL_QUERY_RESULT, &ns);
+            query.pending = false;
+            if (query.frame + HISTORY > _frame) {
+                accumulate(_frames[query.frame % HISTORY].gpu[query.section], ns * 1e-6);
+            }
+        }
+    }
+}
+
+
+void Profiler::values(unsigned section, Source source, std::vector<float> & out) const {
+    out.clear();
+    uint64_t frames = std::min<uint64_t>(_frame, HISTORY);
+    for (uint64_t i=_frame - frames; i<_frame; ++i) {
+        const Frame & frame = _frames[i % HISTORY];
+        float sample;
+        if (section == ~0u) {
+            sample = frame.total;
+        } else if (source == SOURCE_GPU) {
+            sample = frame.gpu[section];
+        } else if (source == SOURCE_COUNT) {
+            sample = frame.count[section];
+        } else {
+            sample = frame.cpu[section];
+        }
+        if (sample >= 0.0f) {
+            out.push_back(sample);
+        }
+    }
+}
+
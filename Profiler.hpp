@@ -0,0 +1,108 @@
+#ifndef Profiler_hpp
+#define Profiler_hpp
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+
+// Per-frame timings of named sections, on the CPU with a steady clock and on
+// the GPU with GL_TIME_ELAPSED queries, plus counts such as draws. GPU
+// results are read a few frames late so waiting on them never stalls the
+// pipeline. The last HISTORY frames are kept for percentile summaries.
+class Profiler {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    enum {
+        HISTORY = 1024,
+        MAX_SECTIONS = 16,
+        QUERY_LATENCY = 4,  // frames of GPU queries in flight
+    };
+
+    enum Source {
+        SOURCE_CPU,
+        SOURCE_GPU,
+        SOURCE_COUNT,
+    };
+
+    // Times the enclosing block on the CPU
+    class CpuScope {
+    public:
+        CpuScope(Profiler & profiler, unsigned section);
+        ~CpuScope();
+
+    private:
+        Profiler &          _profiler;
+        unsigned            _section;
+        Clock::time_point   _start;
+    };
+
+    // Times the GL commands issued in the enclosing block. GPU scopes may
+    // not nest or overlap, as only one time query can be active.
+    class GpuScope {
+    public:
+        GpuScope(Profiler & profiler, unsigned section);
+        ~GpuScope();
+
+    private:
+        Profiler &  _profiler;
+    };
+
+    Profiler();
+    Profiler(const Profiler &) = delete;
+    Profiler & operator=(const Profiler &) = delete;
+    ~Profiler();
+
+    // Returns the id of the section with this name, adding it if needed
+    unsigned section(const char * name);
+
+    void beginFrame();
+    void endFrame();
+
+    // Adds to this frame's count for the section
+    void count(unsigned section, double value);
+
+    // Value at percentile p of the recorded frames, in milliseconds for
+    // times. The whole frame's time if section is ~0u. Returns 0 if there
+    // are no samples.
+    double percentile(double p, unsigned section = ~0u, Source source = SOURCE_CPU) const;
+
+    // One row per section and source with the sample count, mean, p50, p95,
+    // p99 and max, in milliseconds for times
+    void writeSummaryCsv(std::ostream & os) const;
+
+    uint64_t frameCount() const {
+        return _frame;
+    }
+
+private:
+    struct Frame {
+        float total;
+        float cpu[MAX_SECTIONS];
+        float gpu[MAX_SECTIONS];    // negative until the query lands
+        float count[MAX_SECTIONS];
+    };
+
+    struct Query {
+        unsigned query;
+        unsigned section;
+        uint64_t frame;
+        bool     pending;
+    };
+
+    void collect();
+    void values(unsigned section, Source source, std::vector<float> & out) const;
+
+    std::vector<std::string> _sections;
+    std::vector<Frame>  _frames;
+    std::vector<Query>  _queries[QUERY_LATENCY];
+    unsigned            _queryCount;    // used so far this frame
+    uint64_t            _frame;
+    Clock::time_point   _frameStart;
+};
+
+
+#endif
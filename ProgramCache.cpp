@@ -0,0 +1,238 @@
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <vector>
+#include <sys/stat.h>
+
+#include "ProgramCache.hpp"
+
+
+namespace {
+
+
+typedef std::chrono::steady_clock Clock;
+
+
+double milliseconds(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+
+// FNV-1a, which is plenty to tell sources apart
+uint64_t hash(const void * data, size_t sz, uint64_t h = 14695981039346656037ull) {
+    const unsigned char * bytes = (const unsigned char*)data;
+    for (size_t i=0; i<sz; ++i) {
+        h = (h ^ bytes[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+
+const char * glString(GLenum name) {
+    const char * value = (const char*)glGetString(name);
+    return value ? value : "";
+}
+
+
+}
+
+
+// Precedes the binary in each file
+struct ProgramCache::Header {
+    enum {
+        MAGIC = 0x42504c47,     // "GLPB"
+        VERSION = 1,
+    };
+
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint64_t checksum;          // of the binary
+    uint32_t format;
+    uint32_t size;
+    double   buildMs;
+};
+
+
+ProgramCache::ProgramCache(const std::string & directory) :
+    _directory(directory),
+    _enabled(!directory.empty() && (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)),
+    _stats() {
+    _driver = std::string(glString(GL_VENDOR)) + "\n" + glString(GL_RENDERER) + "\n" + glString(GL_VERSION);
+    if (_enabled) {
+        mkdir(_directory.c_str(), 0755);
+
+        // Binaries in any other format would only raise an error
+        GLint formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        _formats.resize(formats);
+        if (formats) {
+            glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, _formats.data());
+        }
+        _enabled = formats > 0;
+    }
+
+    // Let the driver build on as many threads as it likes
+    if (GLEW_KHR_parallel_shader_compile) {
+        glMaxShaderCompilerThreadsKHR(0xffffffff);
+    }
+}
+
+
+ShaderProgram ProgramCache::link(const Source * sources, unsigned count) {
+    uint64_t key = hash(_driver.data(), _driver.size());
+    for (unsigned i=0; i<count; ++i) {
+        key = hash(&sources[i].type, sizeof(sources[i].type), key);
+        key = hash(sources[i].code, strlen(sources[i].code), key);
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)key);
+    std::string path = _directory + name;
+
+    ShaderProgram program;
+    if (_enabled) {
+        if (load(program, key, path)) {
+            return program;
+        }
+        // Start over, as a refused binary may leave the program in any state
+        program = ShaderProgram();
+    }
+
+    // Build it from source, keeping the result for next time once it is done
+    ++_stats.misses;
+    Clock::time_point start = Clock::now();
+    for (unsigned i=0; i<count; ++i) {
+        Shader shader(sources[i].type);
+        shader.compile(sources[i].code);
+        program.attach(std::move(shader));
+    }
+    if (_enabled) {
+        glProgramParameteri(*program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    program.linkAsync();
+
+    Pending pending = {unsigned(*program), key, path, milliseconds(start)};
+    _pending.push_back(pending);
+    return program;
+}
+
+
+void ProgramCache::update() {
+    for (unsigned i=0; i<_pending.size();) {
+        const Pending & pending = _pending[i];
+        GLint done = GL_TRUE;
+        if (GLEW_KHR_parallel_shader_compile) {
+            glGetProgramiv(pending.program, GL_COMPLETION_STATUS_KHR, &done);
+        }
+        if (!done) {
+            ++i;
+            continue;
+        }
+
+        // Count the time this thread spent on it, submitting and then
+        // waiting here for any of the build left over
+        Clock::time_point start = Clock::now();
+        GLint linked = GL_FALSE;
+        glGetProgramiv(pending.program, GL_LINK_STATUS, &linked);
+        double buildMs = pending.submitMs + milliseconds(start);
+        _stats.buildMs += buildMs;
+        if (_enabled && linked) {
+            store(pending.program, pending.key, pending.path, buildMs);
+        }
+        _pending[i] = _pending.back();
+        _pending.pop_back();
+    }
+}
+
+
+void ProgramCache::writeSummary(std::ostream & os) const {
+    os << "shader cache " << (_enabled ? _directory : "off")
+       << " hits " << _stats.hits
+       << " misses " << _stats.misses
+       << " rejected " << _stats.rejected
+       << " load " << _stats.loadMs << "ms"
+       << " build " << _stats.buildMs << "ms"
+       << " saved " << _stats.savedMs << "ms" << std::endl;
+}
+
+
+bool ProgramCache::load(ShaderProgram & program, uint64_t key, const std::string & path) {
+    Clock::time_point start = Clock::now();
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    // Check everything before the driver sees it
+    file.seekg(0, std::ios::end);
+    uint64_t fileSz = file.tellg();
+    file.seekg(0);
+    Header header;
+    std::vector<char> binary;
+    bool valid = fileSz >= sizeof(header) &&
+                 file.read((char*)&header, sizeof(header)) &&
+                 header.magic == Header::MAGIC &&
+                 header.version == Header::VERSION &&
+                 header.key == key &&
+                 header.size == fileSz - sizeof(header) &&
+                 std::find(_formats.begin(), _formats.end(), GLint(header.format)) != _formats.end();
+    if (valid) {
+        binary.resize(header.size);
+        valid = file.read(binary.data(), binary.size()) &&
+                hash(binary.data(), binary.size()) == header.checksum;
+    }
+
+    // The driver may still refuse it, say after an update that kept the
+    // version string
+    GLint linked = GL_FALSE;
+    if (valid) {
+        glProgramBinary(*program, header.format, binary.data(), binary.size());
+        glGetProgramiv(*program, GL_LINK_STATUS, &linked);
+    }
+    if (!linked) {
+        ++_stats.rejected;
+        return false;
+    }
+
+    double loadMs = milliseconds(start);
+    ++_stats.hits;
+    _stats.loadMs += loadMs;
+    _stats.savedMs += header.buildMs - loadMs;
+    return true;
+}
+
+
+void ProgramCache::store(unsigned program, uint64_t key, const std::string & path, double buildMs) {
+    GLint size = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+    if (size <= 0) {
+        return;
+    }
+    std::vector<char> binary(size);
+    GLenum format = 0;
+    glGetProgramBinary(program, size, &size, &format, binary.data());
+    binary.resize(size);
+
+    Header header = {Header::MAGIC, Header::VERSION, key, hash(binary.data(), binary.size()), format, uint32_t(size), buildMs};
+
+    // Written aside and renamed into place, so a crash or another instance
+    // never leaves a half written entry
+    std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream file(tmpPath, std::ios::binary);
+        file.write((const char*)&header, sizeof(header));
+        file.write(binary.data(), binary.size());
+        if (!file) {
+            remove(tmpPath.c_str());
+            return;
+        }
+    }
+    rename(tmpPath.c_str(), path.c_str());
+}
+
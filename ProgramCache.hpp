@@ -0,0 +1,79 @@
+#ifndef ProgramCache_hpp
+#define ProgramCache_hpp
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include "Shader.hpp"
+
+
+// Links shader programs, keeping their binaries on disk so later runs can
+// skip compiling. Entries are keyed by a hash of the sources and the GL
+// vendor, renderer and version, so a driver update misses rather than
+// loading a binary it cannot use. Anything unreadable, corrupt or refused
+// by the driver is rebuilt from source and written again.
+//
+// Programs built from source are returned still linking, and where the
+// driver has KHR_parallel_shader_compile several build at once. Their
+// errors surface when they are first used. Their binaries are stored by
+// update once they finish, so they have to live until then.
+//
+// With no directory, or without GL 4.1 or ARB_get_program_binary, every
+// program is built from source.
+class ProgramCache {
+public:
+    struct Source {
+        unsigned    type;
+        const char * code;
+    };
+
+    struct Stats {
+        unsigned hits;
+        unsigned misses;
+        unsigned rejected;  // entries found but unusable, also misses
+        double   loadMs;    // spent loading binaries
+        double   buildMs;   // spent compiling and linking, or waiting on it
+        double   savedMs;   // build time of the hits, less their load time
+    };
+
+    // Needs a current context. The directory is created if needed.
+    explicit ProgramCache(const std::string & directory = std::string());
+
+    ShaderProgram link(const Source * sources, unsigned count);
+
+    // Stores the programs that have finished linking, without waiting for
+    // the rest
+    void update();
+
+    const Stats & stats() const {
+        return _stats;
+    }
+
+    // One line summary of the stats
+    void writeSummary(std::ostream & os) const;
+
+private:
+    struct Header;
+
+    struct Pending {
+        unsigned    program;
+        uint64_t    key;
+        std::string path;
+        double      submitMs;
+    };
+
+    bool load(ShaderProgram & program, uint64_t key, const std::string & path);
+    void store(unsigned program, uint64_t key, const std::string & path, double buildMs);
+
+    std::string _directory;
+    std::string _driver;
+    std::vector<int> _formats;
+    std::vector<Pending> _pending;
+    bool        _enabled;
+    Stats       _stats;
+};
+
+
+#endif
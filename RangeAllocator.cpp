@@ -0,0 +1,469 @@
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "RangeAllocator.hpp"
+
+
+namespace {
+
+
+unsigned msb(unsigned x) {
+    return 31 - __builtin_clz(x);
+}
+
+
+unsigned lsb(unsigned x) {
+    return __builtin_ctz(x);
+}
+
+
+}
+
+
+RangeAllocator::RangeAllocator() :
+    _first(nullptr),
+    _last(nullptr),
+    _spare(nullptr),
+    _poolUsed(0),
+    _flBitmap(0),
+    _size(0),
+    _freeBytes(0),
+    _freeRegions(0) {
+    memset(_slBitmap, 0, sizeof(_slBitmap));
+    memset(_heads, 0, sizeof(_heads));
+}
+
+
+RangeAllocator::RangeAllocator(RangeAllocator && rhs) :
+    RangeAllocator() {
+    *this = std::move(rhs);
+}
+
+
+RangeAllocator & RangeAllocator::operator=(RangeAllocator && rhs) {
+    // Nodes live in the pool chunks, so moving the chunks keeps every
+    // outstanding Region pointer valid
+    _pool = std::move(rhs._pool);
+    _first = rhs._first;
+    _last = rhs._last;
+    _spare = rhs._spare;
+    _poolUsed = rhs._poolUsed;
+    _flBitmap = rhs._flBitmap;
+    memcpy(_slBitmap, rhs._slBitmap, sizeof(_slBitmap));
+    memcpy(_heads, rhs._heads, sizeof(_heads));
+    _size = rhs._size;
+    _freeBytes = rhs._freeBytes;
+    _freeRegions = rhs._freeRegions;
+
+    rhs._pool.clear();
+    rhs._first = nullptr;
+    rhs._last = nullptr;
+    rhs._spare = nullptr;
+    rhs._poolUsed = 0;
+    rhs._flBitmap = 0;
+    memset(rhs._slBitmap, 0, sizeof(rhs._slBitmap));
+    memset(rhs._heads, 0, sizeof(rhs._heads));
+    rhs._size = 0;
+    rhs._freeBytes = 0;
+    rhs._freeRegions = 0;
+    return *this;
+}
+
+
+RangeAllocator::RangeAllocator(unsigned size) :
+    RangeAllocator() {
+    // Add the initial range
+    Region * region = newRegion();
+    region->start = 0;
+    region->end = size;
+    region->prevPhys = nullptr;
+    region->nextPhys = nullptr;
+    insertFree(region);
+    _first = region;
+    _last = region;
+    _size = size;
+}
+
+
+RangeAllocator::Region * RangeAllocator::allocate(unsigned sz, unsigned align) {
+    // Find a good fit. With alignment the region might need padding at the
+    // front, so if the first candidate is too small look for one that fits
+    // whatever its alignment.
+    Region * region = findFree(sz);
+    unsigned pad = region && align > 1 ? (align - region->start % align) % align : 0;
+    if (region && region->end - region->start < uint64_t(sz) + pad) {
+        region = nullptr;
+        if (uint64_t(sz) + align - 1 <= 0xffffffffu) {
+            region = findFree(sz + align - 1);
+            pad = region ? (align - region->start % align) % align : 0;
+        }
+    }
+    if (!region) {
+        return nullptr;
+    }
+
+    // Grab the new nodes up front so running out of memory leaves us intact
+    Region * head = nullptr;
+    Region * tail = nullptr;
+    if (pad) {
+        head = newRegion();
+    }
+    if (region->end - region->start != sz + pad) {
+        tail = newRegion();
+    }
+
+    // Remove this region from the index
+    removeFree(region);
+    region->align = align;
+
+    // If there is padding then split it off the front
+    if (head) {
+        head->start = region->start;
+        head->end = region->start + pad;
+        region->start = head->end;
+
+        head->prevPhys = region->prevPhys;
+        head->nextPhys = region;
+        if (head->prevPhys) {
+            head->prevPhys->nextPhys = head;
+        } else {
+            _first = head;
+        }
+        region->prevPhys = head;
+        insertFree(head);
+    }
+
+    // If there is a tail then split the region
+    if (tail) {
+        tail->start = region->start + sz;
+        tail->end = region->end;
+        region->end = tail->start;
+
+        tail->prevPhys = region;
+        tail->nextPhys = region->nextPhys;
+        if (tail->nextPhys) {
+            tail->nextPhys->prevPhys = tail;
+        } else {
+            _last = tail;
+        }
+        region->nextPhys = tail;
+        insertFree(tail);
+    }
+
+    return region;
+}
+
+
+void RangeAllocator::free(Region * region) {
+    // Merge with a free section before
+    Region * prev = region->prevPhys;
+    if (prev && prev->isFree) {
+        removeFree(prev);
+        region->start = prev->start;
+        region->prevPhys = prev->prevPhys;
+        if (region->prevPhys) {
+            region->prevPhys->nextPhys = region;
+        } else {
+            _first = region;
+        }
+        deleteRegion(prev);
+    }
+
+    // Merge with a free section after
+    Region * next = region->nextPhys;
+    if (next && next->isFree) {
+        removeFree(next);
+        region->end = next->end;
+        region->nextPhys = next->nextPhys;
+        if (region->nextPhys) {
+            region->nextPhys->prevPhys = region;
+        } else {
+            _last = region;
+        }
+        deleteRegion(next);
+    }
+
+    // Insert into index
+    insertFree(region);
+}
+
+
+RangeAllocator::Region * RangeAllocator::split(Region * region, unsigned sz) {
+    Region * tail = newRegion();
+    tail->start = region->start + sz;
+    tail->end = region->end;
+    tail->isFree = false;
+    tail->align = region->align;
+    region->end = tail->start;
+
+    tail->prevPhys = region;
+    tail->nextPhys = region->nextPhys;
+    if (tail->nextPhys) {
+        tail->nextPhys->prevPhys = tail;
+    } else {
+        _last = tail;
+    }
+    region->nextPhys = tail;
+    return tail;
+}
+
+
+void RangeAllocator::grow(unsigned newSize) {
+    if (newSize <= _size) {
+        return;
+    }
+
+    // Extend the last region if it is free, otherwise append a new one
+    if (_last && _last->isFree) {
+        removeFree(_last);
+        _last->end = newSize;
+        insertFree(_last);
+    } else {
+        Region * region = newRegion();
+        region->start = _size;
+        region->end = newSize;
+        region->prevPhys = _last;
+        region->nextPhys = nullptr;
+        if (_last) {
+            _last->nextPhys = region;
+        } else {
+            _first = region;
+        }
+        _last = region;
+        insertFree(region);
+    }
+    _size = newSize;
+}
+
+
+bool RangeAllocator::compact(unsigned budget, std::vector<Move> & moves) {
+    // Everything before the first hole is already packed
+    Region * hole = _first;
+    while (hole && !hole->isFree) {
+        hole = hole->nextPhys;
+    }
+
+    unsigned moved = 0;
+    while (hole && moved < budget) {
+        Region * used = hole->nextPhys;
+        if (!used) {
+            // The only hole is at the end, so we are done
+            return false;
+        }
+
+        // The region has to keep its alignment, which may leave a little
+        // padding behind, or stop it moving at all
+        unsigned sz = used->end - used->start;
+        unsigned holeSz = hole->end - hole->start;
+        unsigned pad = used->align > 1 ? (used->align - hole->start % used->align) % used->align : 0;
+        if (pad >= holeSz) {
+            hole = used->nextPhys;
+            while (hole && !hole->isFree) {
+                hole = hole->nextPhys;
+            }
+            continue;
+        }
+
+        Region * prev = hole->prevPhys;
+        Region * next = used->nextPhys;
+        if (pad) {
+            // Shrink the hole down to the padding and start a new one after
+            Region * after = newRegion();
+            removeFree(hole);
+            hole->end = hole->start + pad;
+            insertFree(hole);
+
+            moves.push_back(Move{used->start, hole->end, sz});
+            after->start = hole->end + sz;
+            after->end = used->end;
+            used->start = hole->end;
+            used->end = after->start;
+
+            hole->nextPhys = used;
+            used->prevPhys = hole;
+            used->nextPhys = after;
+            after->prevPhys = used;
+            after->nextPhys = next;
+            if (next) {
+                next->prevPhys = after;
+            } else {
+                _last = after;
+            }
+            insertFree(after);
+            hole = after;
+        } else {
+            // Swap the hole with the used region after it. The hole keeps its
+            // size so it stays in the same bucket.
+            moves.push_back(Move{used->start, hole->start, sz});
+            used->start = hole->start;
+            used->end = hole->start + sz;
+            hole->start = used->end;
+            hole->end = used->end + holeSz;
+
+            used->prevPhys = prev;
+            used->nextPhys = hole;
+            hole->prevPhys = used;
+            hole->nextPhys = next;
+            if (prev) {
+                prev->nextPhys = used;
+            } else {
+                _first = used;
+            }
+            if (next) {
+                next->prevPhys = hole;
+            } else {
+                _last = hole;
+            }
+        }
+        moved += sz;
+
+        // Absorb the following hole, if any
+        if (next && next->isFree) {
+            removeFree(hole);
+            removeFree(next);
+            hole->end = next->end;
+            hole->nextPhys = next->nextPhys;
+            if (hole->nextPhys) {
+                hole->nextPhys->prevPhys = hole;
+            } else {
+                _last = hole;
+            }
+            deleteRegion(next);
+            insertFree(hole);
+        }
+    }
+    return hole && hole->nextPhys;
+}
+
+
+unsigned RangeAllocator::largestFree() const {
+    if (!_flBitmap) {
+        return 0;
+    }
+
+    // The largest block is somewhere in the highest non-empty bucket
+    unsigned fl = msb(_flBitmap);
+    unsigned sl = msb(_slBitmap[fl]);
+    unsigned largest = 0;
+    for (Region * region = _heads[fl][sl]; region; region = region->nextFree) {
+        largest = std::max(largest, region->end - region->start);
+    }
+    return largest;
+}
+
+
+void RangeAllocator::mapping(unsigned sz, unsigned & fl, unsigned & sl) {
+    // Small sizes get a linear first level, everything else is split into
+    // SL_COUNT buckets per power of two
+    if (sz < SL_COUNT) {
+        fl = 0;
+        sl = sz;
+    } else {
+        unsigned t = msb(sz);
+        sl = (sz >> (t - SL_LOG2)) ^ SL_COUNT;
+        fl = t - SL_LOG2 + 1;
+    }
+}
+
+
+RangeAllocator::Region * RangeAllocator::findFree(unsigned sz) {
+    unsigned fl, sl;
+
+    // Round up to the next bucket so anything we find is large enough
+    uint64_t rounded = sz;
+    if (sz >= SL_COUNT) {
+        rounded += (uint64_t(1) << (msb(sz) - SL_LOG2)) - 1;
+    }
+    if (rounded <= 0xffffffffu) {
+        mapping(unsigned(rounded), fl, sl);
+
+        uint32_t slMap = _slBitmap[fl] & (~0u << sl);
+        if (!slMap) {
+            uint32_t flMap = fl + 1 < FL_COUNT ? _flBitmap & (~0u << (fl + 1)) : 0;
+            if (flMap) {
+                fl = lsb(flMap);
+                slMap = _slBitmap[fl];
+            }
+        }
+        if (slMap) {
+            return _heads[fl][lsb(slMap)];
+        }
+    }
+
+    // Nothing in a larger bucket, but the head of our own bucket may still fit
+    mapping(sz, fl, sl);
+    Region * region = _heads[fl][sl];
+    if (region && region->end - region->start >= sz) {
+        return region;
+    }
+    return nullptr;
+}
+
+
+void RangeAllocator::insertFree(Region * region) {
+    unsigned fl, sl;
+    mapping(region->end - region->start, fl, sl);
+
+    region->isFree = true;
+    _freeBytes += region->end - region->start;
+    ++_freeRegions;
+    region->prevFree = nullptr;
+    region->nextFree = _heads[fl][sl];
+    if (region->nextFree) {
+        region->nextFree->prevFree = region;
+    }
+    _heads[fl][sl] = region;
+
+    _flBitmap |= 1u << fl;
+    _slBitmap[fl] |= 1u << sl;
+}
+
+
+void RangeAllocator::removeFree(Region * region) {
+    unsigned fl, sl;
+    mapping(region->end - region->start, fl, sl);
+
+    region->isFree = false;
+    _freeBytes -= region->end - region->start;
+    --_freeRegions;
+    if (region->nextFree) {
+        region->nextFree->prevFree = region->prevFree;
+    }
+    if (region->prevFree) {
+        region->prevFree->nextFree = region->nextFree;
+    } else {
+        _heads[fl][sl] = region->nextFree;
+        if (!_heads[fl][sl]) {
+            _slBitmap[fl] &= ~(1u << sl);
+            if (!_slBitmap[fl]) {
+                _flBitmap &= ~(1u << fl);
+            }
+        }
+    }
+}
+
+
+RangeAllocator::Region * RangeAllocator::newRegion() {
+    // Reuse a recycled node if we have one
+    if (_spare) {
+        Region * region = _spare;
+        _spare = region->nextFree;
+        return region;
+    }
+
+    // Otherwise carve one out of the current chunk
+    if (_pool.empty() || _poolUsed == POOL_CHUNK) {
+        _pool.emplace_back(new Region[POOL_CHUNK]);
+        _poolUsed = 0;
+    }
+    return &_pool.back()[_poolUsed++];
+}
+
+
+void RangeAllocator::deleteRegion(Region * region) {
+    region->nextFree = _spare;
+    _spare = region;
+}
+
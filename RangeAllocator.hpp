@@ -0,0 +1,103 @@
+#ifndef RangeAllocator_hpp
+#define RangeAllocator_hpp
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+
+// Two-level segregated fit allocator over an abstract range [0, size). Knows
+// nothing about OpenGL, it only does the bookkeeping. Allocate and free are
+// constant time, and region nodes are pooled so neither calls new.
+class RangeAllocator {
+public:
+    struct Region {
+        unsigned start;
+        unsigned end;
+
+    private:
+        Region * prevPhys;  // neighbours in address order
+        Region * nextPhys;
+        Region * prevFree;  // neighbours in the free list (or pool link)
+        Region * nextFree;
+        unsigned align;     // kept when compaction moves the region
+        bool     isFree;
+        friend class RangeAllocator;
+    };
+
+    struct Move {
+        unsigned src;
+        unsigned dst;
+        unsigned sz;
+    };
+
+    RangeAllocator();
+    RangeAllocator(RangeAllocator && rhs);
+    RangeAllocator & operator=(RangeAllocator && rhs);
+    explicit RangeAllocator(unsigned size);
+
+    // Returns nullptr if there is no free region large enough. The start of
+    // the region is a multiple of align, which need not be a power of two.
+    Region * allocate(unsigned sz, unsigned align = 1);
+    void free(Region * region);
+
+    // Splits a used region after sz bytes, the remainder is returned as a
+    // separate used region with the same alignment
+    Region * split(Region * region, unsigned sz);
+
+    // Extends the range to newSize, the new space is free
+    void grow(unsigned newSize);
+
+    // Slides used regions down into the holes in front of them until about
+    // budget bytes have been moved. Regions are updated in place, and the
+    // moves the caller must perform on the data are appended to moves.
+    // Returns false once the range is fully packed.
+    bool compact(unsigned budget, std::vector<Move> & moves);
+
+    unsigned size() const {
+        return _size;
+    }
+
+    unsigned freeBytes() const {
+        return _freeBytes;
+    }
+
+    unsigned freeRegions() const {
+        return _freeRegions;
+    }
+
+    unsigned largestFree() const;
+
+private:
+    enum {
+        SL_LOG2 = 4,
+        SL_COUNT = 1 << SL_LOG2,
+        FL_COUNT = 32 - SL_LOG2 + 1,
+        POOL_CHUNK = 256,
+    };
+
+    static void mapping(unsigned sz, unsigned & fl, unsigned & sl);
+    Region * findFree(unsigned sz);
+
+    void insertFree(Region * region);
+    void removeFree(Region * region);
+
+    Region * newRegion();
+    void deleteRegion(Region * region);
+
+    std::vector<std::unique_ptr<Region[]>> _pool;
+    Region *        _first;     // lowest and highest regions by address
+    Region *        _last;
+    Region *        _spare;     // recycled nodes, linked through nextFree
+    unsigned        _poolUsed;  // nodes handed out from the last chunk
+
+    uint32_t        _flBitmap;
+    uint32_t        _slBitmap[FL_COUNT];
+    Region *        _heads[FL_COUNT][SL_COUNT];
+    unsigned        _size;
+    unsigned        _freeBytes;
+    unsigned        _freeRegions;
+};
+
+
+#endif
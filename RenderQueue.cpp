@@ -0,0 +1,201 @@
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <algorithm>
+
+#include "GLState.hpp"
+#include "RenderQueue.hpp"
+
+
+namespace {
+
+
+uint64_t field(unsigned value, unsigned bits, unsigned shift) {
+    return uint64_t(value & ((1u << bits) - 1)) << shift;
+}
+
+
+unsigned indexSize(unsigned indexType) {
+    return indexType == GL_UNSIGNED_SHORT ? 2 : 4;
+}
+
+
+}
+
+
+uint64_t RenderQueue::makeKey(unsigned pass, unsigned program, unsigned vertexArray, float depth) {
+    depth = std::min(std::max(depth, 0.0f), 1.0f);
+    unsigned quantised = unsigned(depth * float((1u << DEPTH_BITS) - 1));
+    return field(pass, PASS_BITS, PROGRAM_BITS + VERTEX_ARRAY_BITS + DEPTH_BITS) |
+           field(program, PROGRAM_BITS, VERTEX_ARRAY_BITS + DEPTH_BITS) |
+           field(vertexArray, VERTEX_ARRAY_BITS, DEPTH_BITS) |
+           field(quantised, DEPTH_BITS, 0);
+}
+
+
+RenderQueue::RenderQueue() :
+    _indirect(GLEW_VERSION_4_3 || GLEW_ARB_multi_draw_indirect),
+    _indirectBuffer(0) {
+    clear();
+}
+
+
+RenderQueue::~RenderQueue() {
+    if (_indirectBuffer) {
+        GLState::deleteBuffers(1, &_indirectBuffer);
+    }
+}
+
+
+void RenderQueue::clear() {
+    _draws.clear();
+    _entries.clear();
+    _stats.draws = 0;
+    _stats.instances = 0;
+    _stats.drawCalls = 0;
+    _stats.programBinds = 0;
+    _stats.vertexArrayBinds = 0;
+}
+
+
+void RenderQueue::push(uint64_t key, const Draw & draw) {
+    Entry entry = {key, unsigned(_draws.size())};
+    _entries.push_back(entry);
+    _draws.push_back(draw);
+}
+
+
+void RenderQueue::submit() {
+    sort();
+    prepare();
+
+    // One multi draw per run of the same program, VAO and index type
+    unsigned n = _entries.size();
+    for (unsigned first=0; first<n;) {
+        const Draw & draw = _draws[_entries[first].draw];
+        const Draw * previous = first ? &_draws[_entries[first - 1].draw] : nullptr;
+        if (!previous || draw.program != previous->program) {
+            GLState::useProgram(draw.program);
+            ++_stats.programBinds;
+        }
+        if (!previous || draw.vertexArray != previous->vertexArray) {
+            GLState::bindVertexArray(draw.vertexArray);
+            ++_stats.vertexArrayBinds;
+        }
+
+        GLState::primitiveRestartIndex(draw.indexType == GL_UNSIGNED_SHORT ? 0xffff : 0xffffffff);
+
+        unsigned last = first + 1;
+        while (last < n && _draws[_entries[last].draw].program == draw.program &&
+               _draws[_entries[last].draw].vertexArray == draw.vertexArray &&
+               _draws[_entries[last].draw].indexType == draw.indexType) {
+            ++last;
+        }
+        drawRun(first, last - first);
+        first = last;
+    }
+    _stats.draws += n;
+}
+
+
+void RenderQueue::prepare() {
+    // Lay out every draw in sorted order, so each run is a contiguous slice
+    if (_indirect) {
+        _commands.resize(_entries.size());
+        for (unsigned i=0; i<_entries.size(); ++i) {
+            const Draw & draw = _draws[_entries[i].draw];
+            Command command = {draw.count, draw.instanceCount, draw.firstIndex, draw.baseVertex, 0};
+            _commands[i] = command;
+            _stats.instances += draw.instanceCount;
+        }
+        if (_commands.empty()) {
+            return;
+        }
+
+        // Orphan last frame's commands rather than wait for them
+        if (!_indirectBuffer) {
+            glGenBuffers(1, &_indirectBuffer);
+        }
+        GLState::bindBuffer(GL_DRAW_INDIRECT_BUFFER, _indirectBuffer);
+        GLsizeiptr sz = _commands.size() * sizeof(Command);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, sz, nullptr, GL_STREAM_DRAW);
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, sz, _commands.data());
+    } else {
+        _counts.resize(_entries.size());
+        _offsets.resize(_entries.size());
+        _baseVertices.resize(_entries.size());
+        _instanceCounts.resize(_entries.size());
+        for (unsigned i=0; i<_entries.size(); ++i) {
+            const Draw & draw = _draws[_entries[i].draw];
+            _counts[i] = draw.count;
+            _offsets[i] = (const void*)(uintptr_t(draw.firstIndex) * indexSize(draw.indexType));
+            _baseVertices[i] = draw.baseVertex;
+            _instanceCounts[i] = draw.instanceCount;
+            _stats.instances += draw.instanceCount;
+        }
+    }
+}
+
+
+void RenderQueue::drawRun(unsigned first, unsigned count) {
+    unsigned indexType = _draws[_entries[first].draw].indexType;
+    if (_indirect) {
+        ++_stats.drawCalls;
+        glMultiDrawElementsIndirect(GL_TRIANGLES, indexType, (const void*)(uintptr_t(first) * sizeof(Command)), count, 0);
+        return;
+    }
+
+    // There is no instanced multi draw without indirect ones
+    bool instanced = false;
+    for (unsigned i=first; i<first + count; ++i) {
+        instanced = instanced || _instanceCounts[i] != 1;
+    }
+    if (instanced) {
+        for (unsigned i=first; i<first + count; ++i) {
+            glDrawElementsInstancedBaseVertex(GL_TRIANGLES, _counts[i], indexType, _offsets[i], _instanceCounts[i], _baseVertices[i]);
+        }
+        _stats.drawCalls += count;
+    } else if (count == 1) {
+        glDrawElementsBaseVertex(GL_TRIANGLES, _counts[first], indexType, _offsets[first], _baseVertices[first]);
+        ++_stats.drawCalls;
+    } else {
+        glMultiDrawElementsBaseVertex(GL_TRIANGLES, &_counts[first], indexType, &_offsets[first], count, &_baseVertices[first]);
+        ++_stats.drawCalls;
+    }
+}
+
+
+void RenderQueue::sort() {
+    // Least significant byte first, with every histogram built in one pass
+    // over the keys and bytes that are the same in every key skipped
+    size_t n = _entries.size();
+    if (n < 2) {
+        return;
+    }
+    size_t counts[8][256] = {};
+    for (const Entry & entry : _entries) {
+        for (int digit=0; digit<8; ++digit) {
+            ++counts[digit][(entry.key >> (8 * digit)) & 0xff];
+        }
+    }
+
+    _scratch.resize(n);
+    for (int digit=0; digit<8; ++digit) {
+        unsigned shift = 8 * digit;
+        if (counts[digit][(_entries[0].key >> shift) & 0xff] == n) {
+            continue;
+        }
+
+        size_t offset = 0;
+        for (size_t & count : counts[digit]) {
+            size_t c = count;
+            count = offset;
+            offset += c;
+        }
+        for (const Entry & entry : _entries) {
+            _scratch[counts[digit][(entry.key >> shift) & 0xff]++] = entry;
+        }
+        _entries.swap(_scratch);
+    }
+}
+
@@ -0,0 +1,109 @@
+#ifndef RenderQueue_hpp
+#define RenderQueue_hpp
+
+#include <cstdint>
+#include <vector>
+
+
+// Collects a frame's draws, each with a 64 bit sort key, then radix sorts
+// them and submits them with a program or VAO bind only where the key moves
+// to a new one. From the top bit down the key holds the pass, program,
+// vertex array and depth, so draws sharing state end up next to each other
+// and front to back within that. Binds go through GLState, so whatever is
+// still bound from the last frame is not bound again either.
+//
+// Each run of draws sharing a program, VAO and index type goes out as a
+// single multi draw, with glMultiDrawElementsIndirect where GL 4.3 or
+// ARB_multi_draw_indirect is there and glMultiDrawElementsBaseVertex
+// otherwise, which falls back to single draws for instanced ones.
+// Instanced draws always start at instance 0, as GL 3.3 has no base
+// instance. Primitive restart uses the all ones index of the run's index
+// type.
+class RenderQueue {
+public:
+    enum {
+        PASS_BITS = 8,
+        PROGRAM_BITS = 16,
+        VERTEX_ARRAY_BITS = 16,
+        DEPTH_BITS = 24,
+    };
+
+    // An indexed triangle draw, with offsets in elements
+    struct Draw {
+        unsigned program;
+        unsigned vertexArray;
+        unsigned count;
+        unsigned firstIndex;
+        int      baseVertex;
+        unsigned instanceCount;
+        unsigned indexType;     // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+    };
+
+    // Counts since the last clear, with binds counted where the draws
+    // change program or VAO. Each of those runs is one draw call.
+    struct Stats {
+        unsigned draws;
+        unsigned instances;
+        unsigned drawCalls;
+        unsigned programBinds;
+        unsigned vertexArrayBinds;
+    };
+
+    // Depth is clamped to [0, 1]. Program and vertex array names only
+    // decide the grouping, so names too large for their field still work.
+    static uint64_t makeKey(unsigned pass, unsigned program, unsigned vertexArray, float depth);
+
+    RenderQueue();
+    RenderQueue(const RenderQueue &) = delete;
+    RenderQueue & operator=(const RenderQueue &) = delete;
+    ~RenderQueue();
+
+    // Empties the queue and the stats for a new frame
+    void clear();
+
+    void push(uint64_t key, const Draw & draw);
+
+    // Sorts and issues everything pushed since the last clear
+    void submit();
+
+    const Stats & stats() const {
+        return _stats;
+    }
+
+private:
+    struct Entry {
+        uint64_t key;
+        unsigned draw;
+    };
+
+    // Laid out as GL reads it from the indirect buffer
+    struct Command {
+        unsigned count;
+        unsigned instanceCount;
+        unsigned firstIndex;
+        int      baseVertex;
+        unsigned baseInstance;
+    };
+
+    void sort();
+    void prepare();
+    void drawRun(unsigned first, unsigned count);
+
+    std::vector<Draw>   _draws;
+    std::vector<Entry>  _entries;
+    std::vector<Entry>  _scratch;
+    Stats               _stats;
+
+    // The sorted draws as indirect commands, or as the arrays the fallback
+    // takes
+    bool                _indirect;
+    unsigned            _indirectBuffer;
+    std::vector<Command> _commands;
+    std::vector<int>    _counts;
+    std::vector<const void *> _offsets;
+    std::vector<int>    _baseVertices;
+    std::vector<int>    _instanceCounts;
+};
+
+
+#endif
@@ -1,12 +1,29 @@
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <algorithm>
 #include <stdexcept>
 #include <cstring>
 
+#include "GLState.hpp"
 #include "Shader.hpp"
 
 
+namespace {
+
+
+// Array names come back as name[0]
+uint32_t activeNameHash(char * name, int len) {
+    if (len > 3 && !strcmp(name + len - 3, "[0]")) {
+        name[len - 3] = '\0';
+    }
+    return nameHash(name);
+}
+
+
+}
+
+
 Shader::Shader(GLenum shaderType) :
 	_shader(glCreateShader(shaderType)) {
 	if (!_shader) {
@@ -33,9 +50,19 @@ Shader::~Shader() {
 
 
 void Shader::load(const char * code) {
+    compile(code);
+    check();
+}
+
+
+void Shader::compile(const char * code) {
 	int len = strlen(code);
 	glShaderSource(_shader, 1, &code, &len);
 	glCompileShader(_shader);
+}
+
+
+void Shader::check() {
 	int status;
 	glGetShaderiv(_shader, GL_COMPILE_STATUS, &status);
 	if (!status) {
@@ -48,7 +75,8 @@ void Shader::load(const char * code) {
 
 
 ShaderProgram::ShaderProgram() :
-    _shaderProgram(glCreateProgram()) {
+    _shaderProgram(glCreateProgram()),
+    _linked(false) {
 	if (!_shaderProgram) {
 		throw std::runtime_error("Could not create shader program");
 	}
@@ -56,19 +84,30 @@ ShaderProgram::ShaderProgram() :
 
 
 ShaderProgram::ShaderProgram(ShaderProgram && rhs) :
-    _shaderProgram(0) {
+    _shaderProgram(0),
+    _linked(false) {
+    std::swap(_shaders, rhs._shaders);
     std::swap(_shaderProgram, rhs._shaderProgram);
+    std::swap(_linked, rhs._linked);
+    std::swap(_uniforms, rhs._uniforms);
+    std::swap(_attributes, rhs._attributes);
+    std::swap(_uniformBlocks, rhs._uniformBlocks);
 }
 
 
 ShaderProgram & ShaderProgram::operator=(ShaderProgram && rhs) {
+    std::swap(_shaders, rhs._shaders);
     std::swap(_shaderProgram, rhs._shaderProgram);
+    std::swap(_linked, rhs._linked);
+    std::swap(_uniforms, rhs._uniforms);
+    std::swap(_attributes, rhs._attributes);
+    std::swap(_uniformBlocks, rhs._uniformBlocks);
     return *this;
 }
 
 
 ShaderProgram::~ShaderProgram() {
-    glDeleteProgram(_shaderProgram);
+    GLState::deleteProgram(_shaderProgram);
 }
 
 
@@ -79,24 +118,123 @@ void ShaderProgram::attach(Shader && shader) {
 
 
 void ShaderProgram::link() {
+    linkAsync();
+    finish();
+}
+
+
+void ShaderProgram::linkAsync() {
+    _linked = false;
     glLinkProgram(_shaderProgram);
+}
+
+
+void ShaderProgram::finish() {
+    if (_linked) {
+        return;
+    }
 	int status;
 	glGetProgramiv(_shaderProgram, GL_LINK_STATUS, &status);
 	if (!status) {
+        // A shader that did not compile explains it better than the linker
+        for (Shader & shader : _shaders) {
+            shader.check();
+        }
 		char info[1024];
 		int infoLen;
 		glGetProgramInfoLog(_shaderProgram, 1024, &infoLen, info);
 		throw std::runtime_error("Error linking shader: " + std::string(info, infoLen));
 	}
+    reflect();
+    _linked = true;
+}
+
+
+int ShaderProgram::uniform(uint32_t name) {
+    finish();
+    return find(_uniforms, name);
+}
+
+
+int ShaderProgram::attribute(uint32_t name) {
+    finish();
+    return find(_attributes, name);
+}
+
+
+int ShaderProgram::uniformBlock(uint32_t name) {
+    finish();
+    return find(_uniformBlocks, name);
+}
+
+
+void ShaderProgram::bindUniformBlock(uint32_t name, unsigned binding) {
+    int block = uniformBlock(name);
+    if (block >= 0) {
+        glUniformBlockBinding(_shaderProgram, block, binding);
+    }
 }
 
 
 int ShaderProgram::getUniformLoc(const std::string & name) {
-    return glGetUniformLocation(_shaderProgram, name.c_str());
+    return uniform(nameHash(name.c_str()));
 }
 
 
 int ShaderProgram::getAttributeLoc(const std::string & name) {
-    return glGetAttribLocation(_shaderProgram, name.c_str());
+    return attribute(nameHash(name.c_str()));
+}
+
+
+void ShaderProgram::reflect() {
+    _uniforms.clear();
+    _attributes.clear();
+    _uniformBlocks.clear();
+
+    char name[256];
+    int len;
+    int size;
+    GLenum type;
+    int count;
+    glGetProgramiv(_shaderProgram, GL_ACTIVE_UNIFORMS, &count);
+    for (int i=0; i<count; ++i) {
+        // Those in blocks have no location
+        glGetActiveUniform(_shaderProgram, i, sizeof(name), &len, &size, &type, name);
+        int location = glGetUniformLocation(_shaderProgram, name);
+        if (location >= 0) {
+            _uniforms.push_back(Binding{activeNameHash(name, len), location});
+        }
+    }
+    glGetProgramiv(_shaderProgram, GL_ACTIVE_ATTRIBUTES, &count);
+    for (int i=0; i<count; ++i) {
+        // Built in inputs have no location either
+        glGetActiveAttrib(_shaderProgram, i, sizeof(name), &len, &size, &type, name);
+        int location = glGetAttribLocation(_shaderProgram, name);
+        if (location >= 0) {
+            _attributes.push_back(Binding{activeNameHash(name, len), location});
+        }
+    }
+    glGetProgramiv(_shaderProgram, GL_ACTIVE_UNIFORM_BLOCKS, &count);
+    for (int i=0; i<count; ++i) {
+        glGetActiveUniformBlockName(_shaderProgram, i, sizeof(name), &len, name);
+        _uniformBlocks.push_back(Binding{activeNameHash(name, len), i});
+    }
+
+    // Two names hashing the same would make one of them unreachable
+    for (std::vector<Binding> * bindings : {&_uniforms, &_attributes, &_uniformBlocks}) {
+        std::sort(bindings->begin(), bindings->end());
+        for (size_t i=1; i<bindings->size(); ++i) {
+            if ((*bindings)[i].name == (*bindings)[i - 1].name) {
+                throw std::runtime_error("Shader program has two names with the same hash");
+            }
+        }
+    }
+}
+
+
+int ShaderProgram::find(const std::vector<Binding> & bindings, uint32_t name) {
+    Binding key = {name, 0};
+    auto it = std::lower_bound(bindings.begin(), bindings.end(), key);
+    return it != bindings.end() && it->name == name ? it->location : -1;
 }
 
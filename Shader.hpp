@@ -1,6 +1,7 @@
 #ifndef Shader_hpp
 #define Shader_hpp
 
+#include <cstdint>
 #include <vector>
 #include <string>
 
@@ -9,6 +10,14 @@
 #define S__LINE__ S_(__LINE__)
 
 
+// FNV-1a of a uniform, attribute or uniform block name, for looking them up
+// in a linked program. Constant for a literal name when used to initialise
+// a constexpr.
+constexpr uint32_t nameHash(const char * name, uint32_t h = 2166136261u) {
+    return *name ? nameHash(name + 1, (h ^ uint8_t(*name)) * 16777619u) : h;
+}
+
+
 class Shader {
 public:
 	Shader(GLenum shaderType);
@@ -18,6 +27,12 @@ public:
 
 	void load(const char * code);
 
+    // Starts compiling, leaving errors for check
+    void compile(const char * code);
+
+    // Waits for compiling to finish and throws if it failed
+    void check();
+
     int operator*() {
         return _shader;
     }
@@ -37,6 +52,23 @@ public:
     void attach(Shader && shader);
     void link();
 
+    // Starts linking, leaving errors for finish or the first location
+    // query. Compiles of the attached shaders need not have been checked.
+    void linkAsync();
+
+    // Waits for linking to finish and throws, with the failing shader's log
+    // if it was a compile error, if it failed
+    void finish();
+
+    // Found in tables of the active names, built once linking finishes, or
+    // -1 if the program has no such name. Arrays go by their name alone.
+    int uniform(uint32_t name);
+    int attribute(uint32_t name);
+    int uniformBlock(uint32_t name);
+
+    // Points the named uniform block, if there is one, at a binding
+    void bindUniformBlock(uint32_t name, unsigned binding);
+
     int getUniformLoc(const std::string & name);
     int getAttributeLoc(const std::string & name);
 
@@ -45,8 +77,26 @@ public:
     }
 
 private:
+    struct Binding {
+        uint32_t name;
+        int location;
+
+        bool operator<(const Binding & rhs) const {
+            return name < rhs.name;
+        }
+    };
+
+    void reflect();
+    static int find(const std::vector<Binding> & bindings, uint32_t name);
+
     std::vector<Shader> _shaders;
     unsigned _shaderProgram;
+    bool _linked;
+
+    // Sorted by name
+    std::vector<Binding> _uniforms;
+    std::vector<Binding> _attributes;
+    std::vector<Binding> _uniformBlocks;
 };
 
 
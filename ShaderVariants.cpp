@@ -0,0 +1,109 @@
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <chrono>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+#include "ShaderVariants.hpp"
+
+
+namespace {
+
+
+typedef std::chrono::steady_clock Clock;
+
+
+double milliseconds(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+
+}
+
+
+ShaderVariants::ShaderVariants(ProgramCache & programCache, const ProgramCache::Source * sources, unsigned count,
+                               const char * const * features, unsigned featureCount) :
+    _programCache(programCache),
+    _sources(sources),
+    _count(count),
+    _features(features),
+    _featureCount(featureCount),
+    _stats() {
+}
+
+
+void ShaderVariants::prepare(uint32_t mask) {
+    if (_variants.count(mask)) {
+        return;
+    }
+    if (_featureCount < 32 && mask >> _featureCount) {
+        throw std::runtime_error("Shader variant mask has unknown features");
+    }
+    Clock::time_point start = Clock::now();
+
+    // Defines go after #version, which has to come first
+    std::string defines;
+    for (unsigned i=0; i<_featureCount; ++i) {
+        if (mask & (1u << i)) {
+            defines += std::string("#define ") + _features[i] + " 1\n";
+        }
+    }
+    std::vector<std::string> codes(_count);
+    std::vector<ProgramCache::Source> sources(_sources, _sources + _count);
+    for (unsigned i=0; i<_count; ++i) {
+        const char * code = _sources[i].code;
+        const char * versionEnd = strchr(code, '\n');
+        if (strncmp(code, "#version", 8) || !versionEnd) {
+            throw std::runtime_error("Shader variant source does not start with #version");
+        }
+        codes[i] = std::string(code, versionEnd + 1) + defines + (versionEnd + 1);
+        sources[i].code = codes[i].c_str();
+    }
+
+    Variant variant = {_programCache.link(sources.data(), _count), false};
+    _variants.emplace(mask, std::move(variant));
+    ++_stats.variants;
+    _stats.buildMs += milliseconds(start);
+}
+
+
+ShaderProgram & ShaderVariants::get(uint32_t mask) {
+    ++_stats.lookups;
+    auto it = _variants.find(mask);
+    if (it == _variants.end()) {
+        prepare(mask);
+        it = _variants.find(mask);
+    }
+
+    Variant & variant = it->second;
+    if (!variant.finished) {
+        Clock::time_point start = Clock::now();
+        variant.program.finish();
+        for (const auto & binding : _blockBindings) {
+            variant.program.bindUniformBlock(binding.first, binding.second);
+        }
+        variant.finished = true;
+        _stats.buildMs += milliseconds(start);
+    }
+    return variant.program;
+}
+
+
+void ShaderVariants::bindUniformBlock(uint32_t name, unsigned binding) {
+    _blockBindings.push_back(std::make_pair(name, binding));
+    for (auto & variant : _variants) {
+        if (variant.second.finished) {
+            variant.second.program.bindUniformBlock(name, binding);
+        }
+    }
+}
+
+
+void ShaderVariants::writeSummary(std::ostream & os) const {
+    os << "shader variants " << _stats.variants
+       << " lookups " << _stats.lookups
+       << " build " << _stats.buildMs << "ms" << std::endl;
+}
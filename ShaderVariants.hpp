@@ -0,0 +1,65 @@
+#ifndef ShaderVariants_hpp
+#define ShaderVariants_hpp
+
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "ProgramCache.hpp"
+
+
+// One set of shader sources built with any combination of feature flags.
+// Bit i of a variant's mask defines features[i] as 1 just after each
+// source's #version line. A variant is only built the first time it is
+// asked for, through the program cache, and is kept after that.
+class ShaderVariants {
+public:
+    struct Stats {
+        unsigned variants;  // built so far
+        uint64_t lookups;
+        double   buildMs;   // spent submitting and waiting on builds
+    };
+
+    // The sources and feature names have to outlive this
+    ShaderVariants(ProgramCache & programCache, const ProgramCache::Source * sources, unsigned count,
+                   const char * const * features, unsigned featureCount);
+    ShaderVariants(const ShaderVariants &) = delete;
+    ShaderVariants & operator=(const ShaderVariants &) = delete;
+
+    // Starts building a variant, if it is not already, without waiting
+    void prepare(uint32_t mask);
+
+    // The linked variant, built now if it has to be. Throws if it failed.
+    ShaderProgram & get(uint32_t mask);
+
+    // Applied to every variant, as it finishes for those still to come
+    void bindUniformBlock(uint32_t name, unsigned binding);
+
+    const Stats & stats() const {
+        return _stats;
+    }
+
+    // One line summary of the stats
+    void writeSummary(std::ostream & os) const;
+
+private:
+    struct Variant {
+        ShaderProgram program;
+        bool          finished;
+    };
+
+    ProgramCache &  _programCache;
+    const ProgramCache::Source * _sources;
+    unsigned        _count;
+    const char * const * _features;
+    unsigned        _featureCount;
+
+    std::map<uint32_t, Variant> _variants;
+    std::vector<std::pair<uint32_t, unsigned>> _blockBindings;
+    Stats           _stats;
+};
+
+
+#endif
@@ -0,0 +1,160 @@
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#include "GLState.hpp"
+#include "StagingRing.hpp"
+
+
+StagingRing::StagingRing() :
+    _mapped(nullptr),
+    _persistent(false),
+    _buffer(0),
+    _size(0),
+    _head(0),
+    _used(0),
+    _pending(0) {
+}
+
+
+StagingRing::StagingRing(StagingRing && rhs) :
+    StagingRing() {
+    *this = std::move(rhs);
+}
+
+
+StagingRing & StagingRing::operator=(StagingRing && rhs) {
+    std::swap(_copies, rhs._copies);
+    std::swap(_batches, rhs._batches);
+    std::swap(_mapped, rhs._mapped);
+    std::swap(_persistent, rhs._persistent);
+    std::swap(_buffer, rhs._buffer);
+    std::swap(_size, rhs._size);
+    std::swap(_head, rhs._head);
+    std::swap(_used, rhs._used);
+    std::swap(_pending, rhs._pending);
+    return *this;
+}
+
+
+StagingRing::StagingRing(unsigned size) :
+    StagingRing() {
+    _size = size;
+    glGenBuffers(1, &_buffer);
+    GLState::bindBuffer(GL_COPY_READ_BUFFER, _buffer);
+    if (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) {
+        // Map once and keep it mapped for the lifetime of the ring
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_COPY_READ_BUFFER, size, 0, flags);
+        _mapped = (char*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, size, flags);
+        _persistent = true;
+    } else {
+        glBufferData(GL_COPY_READ_BUFFER, size, 0, GL_STREAM_COPY);
+    }
+}
+
+
+StagingRing::~StagingRing() {
+    for (const Batch & batch : _batches) {
+        glDeleteSync((GLsync)batch.fence);
+    }
+    GLState::deleteBuffers(1, &_buffer);
+}
+
+
+bool StagingRing::upload(unsigned dstBuffer, unsigned dstOffset, const void * data, unsigned sz) {
+    void * buf = reserve(dstBuffer, dstOffset, sz);
+    if (!buf) {
+        return false;
+    }
+    memcpy(buf, data, sz);
+    return true;
+}
+
+
+void * StagingRing::reserve(unsigned dstBuffer, unsigned dstOffset, unsigned sz) {
+    if (!_buffer) {
+        return nullptr;
+    }
+
+    // Map the orphaned buffer at the first upload of the frame
+    if (!_persistent && !_mapped) {
+        GLState::bindBuffer(GL_COPY_READ_BUFFER, _buffer);
+        glBufferData(GL_COPY_READ_BUFFER, _size, 0, GL_STREAM_COPY);
+        _mapped = (char*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, _size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (!_mapped) {
+            return nullptr;
+        }
+    }
+
+    // Reclaim space the GPU has finished copying out of
+    retire();
+    if (!_used) {
+        _head = 0;
+    }
+
+    // Uploads must be contiguous, so skip the tail of the ring if needed
+    unsigned padding = _head + sz > _size ? _size - _head : 0;
+    if (uint64_t(_used) + padding + sz > _size) {
+        return nullptr;
+    }
+    if (padding) {
+        _head = 0;
+    }
+
+    char * buf = _mapped + _head;
+    _copies.push_back(Copy{dstBuffer, _head, dstOffset, sz});
+    _head += sz;
+    _used += padding + sz;
+    _pending += padding + sz;
+    return buf;
+}
+
+
+void StagingRing::flush() {
+    if (_copies.empty()) {
+        return;
+    }
+
+    // The fallback mapping has to be released before the GPU can read it
+    GLState::bindBuffer(GL_COPY_READ_BUFFER, _buffer);
+    if (!_persistent) {
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+        _mapped = nullptr;
+    }
+
+    // Copy everything to its final home
+    for (const Copy & copy : _copies) {
+        GLState::bindBuffer(GL_COPY_WRITE_BUFFER, copy.dstBuffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, copy.srcOffset, copy.dstOffset, copy.sz);
+    }
+    _copies.clear();
+
+    if (_persistent) {
+        // Fence the space so it is not overwritten while still being read
+        _batches.push_back(Batch{glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0), _pending});
+    } else {
+        // The next frame orphans the buffer so everything is free again
+        _head = 0;
+        _used = 0;
+    }
+    _pending = 0;
+}
+
+
+void StagingRing::retire() {
+    while (!_batches.empty()) {
+        GLsync fence = (GLsync)_batches.front().fence;
+        GLenum status = glClientWaitSync(fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+            break;
+        }
+        glDeleteSync(fence);
+        _used -= _batches.front().sz;
+        _batches.pop_front();
+    }
+}
+
@@ -0,0 +1,58 @@
+#ifndef StagingRing_hpp
+#define StagingRing_hpp
+
+#include <deque>
+#include <vector>
+
+
+// Ring of CPU-writable memory that uploads are written into and later copied
+// into their destination buffers on the GPU. Uses a persistently mapped
+// buffer when ARB_buffer_storage is available and an orphaned mapping per
+// frame otherwise.
+class StagingRing {
+public:
+    StagingRing();
+    StagingRing(StagingRing && rhs);
+    StagingRing & operator=(StagingRing && rhs);
+    explicit StagingRing(unsigned size);
+    ~StagingRing();
+
+    // Queues a copy of data into dstBuffer at dstOffset. Returns false if
+    // the ring has no room, in which case the caller should upload directly.
+    bool upload(unsigned dstBuffer, unsigned dstOffset, const void * data, unsigned sz);
+
+    // As upload, but returns memory for the caller to fill instead, or
+    // nullptr if the ring has no room. Must be filled before the next flush.
+    void * reserve(unsigned dstBuffer, unsigned dstOffset, unsigned sz);
+
+    // Issues every queued copy, should be called once per frame
+    void flush();
+
+private:
+    struct Copy {
+        unsigned dstBuffer;
+        unsigned srcOffset;
+        unsigned dstOffset;
+        unsigned sz;
+    };
+
+    struct Batch {
+        void *   fence;
+        unsigned sz;
+    };
+
+    void retire();
+
+    std::vector<Copy>   _copies;
+    std::deque<Batch>   _batches;   // flushed but possibly still being read
+    char *          _mapped;
+    bool            _persistent;
+    unsigned        _buffer;
+    unsigned        _size;
+    unsigned        _head;      // next write position
+    unsigned        _used;      // bytes in flight or queued, including padding
+    unsigned        _pending;   // bytes queued since the last flush
+};
+
+
+#endif
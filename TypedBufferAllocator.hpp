@@ -0,0 +1,131 @@
+#ifndef TypedBufferAllocator_hpp
+#define TypedBufferAllocator_hpp
+
+#include <iosfwd>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "BufferAllocator.hpp"
+
+
+// BufferAllocator holding arrays of T. Every allocation is aligned to
+// sizeof(T) so its offset is a whole number of elements, which is what
+// base vertex draws and index offsets want.
+template<typename T>
+class TypedBufferAllocator {
+public:
+    class Ref {
+    public:
+        Ref() {
+        }
+
+        // Offset in elements
+        unsigned operator*() const {
+            return *_ref / sizeof(T);
+        }
+
+        unsigned byteOffset() const {
+            return *_ref;
+        }
+
+        unsigned count() const {
+            return _ref.size() / sizeof(T);
+        }
+
+        unsigned buffer() const {
+            return _ref.buffer();
+        }
+
+        unsigned page() const {
+            return _ref.page();
+        }
+
+        // Wraps an allocation made through allocator(), which must be
+        // aligned to sizeof(T)
+        explicit Ref(BufferAllocator::Ref ref) :
+            _ref(ref) {
+        }
+
+    private:
+        BufferAllocator::Ref _ref;
+        friend class TypedBufferAllocator;
+    };
+
+    struct Upload {
+        const T * data;
+        unsigned  count;
+    };
+
+    TypedBufferAllocator() {
+    }
+
+    TypedBufferAllocator(unsigned initialSz, unsigned target, unsigned usage, StagingRing * staging = nullptr, bool paged = false) :
+        _allocator(initialSz, target, usage, staging, paged) {
+    }
+
+    Ref allocate(const T * data, unsigned count) {
+        return Ref(_allocator.allocate((void*)data, bytes(count), sizeof(T)));
+    }
+
+    void free(Ref ref) {
+        _allocator.free(ref._ref);
+    }
+
+    // See BufferAllocator::allocateBatch
+    std::vector<Ref> allocateBatch(const Upload * uploads, unsigned count) {
+        _uploads.resize(count);
+        for (unsigned i=0; i<count; ++i) {
+            _uploads[i].data = uploads[i].data;
+            _uploads[i].sz = bytes(uploads[i].count);
+        }
+        std::vector<Ref> refs;
+        for (const BufferAllocator::Ref & ref : _allocator.allocateBatch(_uploads.data(), count, sizeof(T))) {
+            refs.push_back(Ref(ref));
+        }
+        return refs;
+    }
+
+    void endFrame() {
+        _allocator.endFrame();
+    }
+
+    bool defragment(unsigned budget) {
+        return _allocator.defragment(budget);
+    }
+
+    AllocatorStats stats() const {
+        return _allocator.stats();
+    }
+
+    void setTrace(std::ostream * os, const char * name) {
+        _allocator.setTrace(os, name);
+    }
+
+    unsigned pageCount() const {
+        return _allocator.pageCount();
+    }
+
+    unsigned buffer(unsigned page) const {
+        return _allocator.buffer(page);
+    }
+
+    BufferAllocator & allocator() {
+        return _allocator;
+    }
+
+    // Sizes are 32 bit all the way down, so this refuses counts that wrap
+    static unsigned bytes(unsigned count) {
+        if (count > 0xffffffffu / sizeof(T)) {
+            throw std::runtime_error("Allocation too large");
+        }
+        return unsigned(count * sizeof(T));
+    }
+
+private:
+    BufferAllocator _allocator;
+    std::vector<BufferAllocator::Upload> _uploads;
+};
+
+
+#endif
@@ -0,0 +1,115 @@
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include "GLState.hpp"
+#include "UniformRing.hpp"
+
+
+UniformRing::UniformRing() :
+    _fences(),
+    _mapped(nullptr),
+    _persistent(false),
+    _buffer(0),
+    _frameSize(0),
+    _alignment(1),
+    _frame(0),
+    _head(0) {
+}
+
+
+UniformRing::UniformRing(UniformRing && rhs) :
+    UniformRing() {
+    *this = std::move(rhs);
+}
+
+
+UniformRing & UniformRing::operator=(UniformRing && rhs) {
+    std::swap(_fences, rhs._fences);
+    std::swap(_mapped, rhs._mapped);
+    std::swap(_persistent, rhs._persistent);
+    std::swap(_buffer, rhs._buffer);
+    std::swap(_frameSize, rhs._frameSize);
+    std::swap(_alignment, rhs._alignment);
+    std::swap(_frame, rhs._frame);
+    std::swap(_head, rhs._head);
+    return *this;
+}
+
+
+UniformRing::UniformRing(unsigned frameSize) :
+    UniformRing() {
+    // Regions start on the binding alignment too
+    GLint alignment;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    _alignment = alignment;
+    _frameSize = (frameSize + _alignment - 1) / _alignment * _alignment;
+
+    glGenBuffers(1, &_buffer);
+    GLState::bindBuffer(GL_UNIFORM_BUFFER, _buffer);
+    unsigned size = _frameSize * FRAMES;
+    if (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) {
+        // Map once and keep it mapped for the lifetime of the ring
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_UNIFORM_BUFFER, size, 0, flags);
+        _mapped = (char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, size, flags);
+        _persistent = true;
+    } else {
+        glBufferData(GL_UNIFORM_BUFFER, size, 0, GL_STREAM_DRAW);
+    }
+}
+
+
+UniformRing::~UniformRing() {
+    for (void * fence : _fences) {
+        if (fence) {
+            glDeleteSync((GLsync)fence);
+        }
+    }
+    if (_buffer) {
+        GLState::deleteBuffers(1, &_buffer);
+    }
+}
+
+
+void UniformRing::beginFrame() {
+    _frame = (_frame + 1) % FRAMES;
+    _head = 0;
+
+    // Only waits when the GPU is FRAMES behind
+    GLsync fence = (GLsync)_fences[_frame];
+    if (fence) {
+        GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(fence);
+        _fences[_frame] = nullptr;
+        if (status == GL_WAIT_FAILED) {
+            throw std::runtime_error("Waiting for the uniform ring failed");
+        }
+    }
+}
+
+
+void UniformRing::push(unsigned binding, const void * data, unsigned sz) {
+    if (_head + sz > _frameSize) {
+        throw std::runtime_error("Uniform ring frame is full");
+    }
+    unsigned offset = _frame * _frameSize + _head;
+    if (_persistent) {
+        memcpy(_mapped + offset, data, sz);
+    } else {
+        GLState::bindBuffer(GL_UNIFORM_BUFFER, _buffer);
+        glBufferSubData(GL_UNIFORM_BUFFER, offset, sz, data);
+    }
+    GLState::bindBufferRange(GL_UNIFORM_BUFFER, binding, _buffer, offset, sz);
+    _head += (sz + _alignment - 1) / _alignment * _alignment;
+}
+
+
+void UniformRing::endFrame() {
+    if (!_fences[_frame]) {
+        _fences[_frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+}
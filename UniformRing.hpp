@@ -0,0 +1,44 @@
+#ifndef UniformRing_hpp
+#define UniformRing_hpp
+
+
+// Uniform buffer space for data set once a frame and shared by every
+// program, such as the camera. Each frame in flight writes its own region,
+// fenced when the frame ends and waited on before it is written again.
+// Uses a persistently mapped buffer when ARB_buffer_storage is available and
+// glBufferSubData otherwise.
+class UniformRing {
+public:
+    UniformRing();
+    UniformRing(UniformRing && rhs);
+    UniformRing & operator=(UniformRing && rhs);
+    explicit UniformRing(unsigned frameSize);
+    ~UniformRing();
+
+    // Moves on to the next region, waiting if the GPU may still read it
+    void beginFrame();
+
+    // Copies data into this frame's region and binds it to a uniform block
+    // binding. Throws if the region is full.
+    void push(unsigned binding, const void * data, unsigned sz);
+
+    // Fences this frame's region
+    void endFrame();
+
+private:
+    enum {
+        FRAMES = 3,
+    };
+
+    void *          _fences[FRAMES];
+    char *          _mapped;
+    bool            _persistent;
+    unsigned        _buffer;
+    unsigned        _frameSize;
+    unsigned        _alignment;
+    unsigned        _frame;
+    unsigned        _head;      // next write position in the frame's region
+};
+
+
+#endif
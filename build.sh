@@ -1,2 +1,4 @@
 #!/bin/bash
-g++ -O3 main.cpp Shader.cpp GLApp.cpp Matrix4.cpp BufferAllocator.cpp -lglfw -lGL -lGLEW
+g++ -O3 main.cpp Shader.cpp GLApp.cpp Matrix4.cpp Frustum.cpp PackedMesh.cpp BufferAllocator.cpp ConcurrentAllocator.cpp RangeAllocator.cpp StagingRing.cpp AllocatorStats.cpp HeadlessContext.cpp Framebuffer.cpp Profiler.cpp RenderQueue.cpp GLState.cpp ProgramCache.cpp ShaderVariants.cpp UniformRing.cpp -pthread -lglfw -lGL -lGLEW -lEGL
+g++ -O3 -o AllocatorBench AllocatorBench.cpp RangeAllocator.cpp
+g++ -O3 -o MathBench MathBench.cpp Matrix4.cpp Frustum.cpp PackedMesh.cpp
@@ -1,16 +1,84 @@
 
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <string>
+#include <thread>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
+#include "Framebuffer.hpp"
 #include "GLApp.hpp"
+#include "GLState.hpp"
+#include "HeadlessContext.hpp"
+#include "ProgramCache.hpp"
+#include "Profiler.hpp"
 
 
 namespace {
 
 
 std::unique_ptr<GLApp> app;
+std::unique_ptr<Profiler> profiler;
+
+
+const double STATS_INTERVAL = 1.0;
+
+
+// The profile summary goes to GLDEMO_PROFILE if set, otherwise stdout
+void writeProfile(const Profiler & profiler) {
+    if (const char * path = getenv("GLDEMO_PROFILE")) {
+        std::ofstream file(path);
+        profiler.writeSummaryCsv(file);
+    } else {
+        profiler.writeSummaryCsv(std::cout);
+    }
+}
+
+
+// Program binaries are kept in GLDEMO_SHADER_CACHE if set
+std::string shaderCacheDirectory() {
+    const char * directory = getenv("GLDEMO_SHADER_CACHE");
+    return directory ? directory : "";
+}
+
+
+// Draws and state changes from the render queue, and the GL calls the state
+// cache let through or skipped, recorded once per frame
+struct RenderCounters {
+    explicit RenderCounters(Profiler & profiler) :
+        draws(profiler.section("draws")),
+        instances(profiler.section("instances")),
+        drawCalls(profiler.section("draw calls")),
+        programBinds(profiler.section("program binds")),
+        vertexArrayBinds(profiler.section("vertex array binds")),
+        stateIssued(profiler.section("state calls issued")),
+        stateSkipped(profiler.section("state calls skipped")) {
+    }
+
+    void record(Profiler & profiler, const GLApp & app) const {
+        const RenderQueue::Stats & stats = app.renderStats();
+        profiler.count(draws, stats.draws);
+        profiler.count(instances, stats.instances);
+        profiler.count(drawCalls, stats.drawCalls);
+        profiler.count(programBinds, stats.programBinds);
+        profiler.count(vertexArrayBinds, stats.vertexArrayBinds);
+        profiler.count(stateIssued, GLState::stats().issued);
+        profiler.count(stateSkipped, GLState::stats().skipped);
+        GLState::resetStats();
+    }
+
+    unsigned draws;
+    unsigned instances;
+    unsigned drawCalls;
+    unsigned programBinds;
+    unsigned vertexArrayBinds;
+    unsigned stateIssued;
+    unsigned stateSkipped;
+};
 
 
 bool hasMouseMoved = false;
@@ -22,6 +90,8 @@ void key_callback(GLFWwindow * window, int key, int scancode, int action, int mo
         app->onKey(key, true);
         if (key == GLFW_KEY_ESCAPE) {
             glfwSetWindowShouldClose(window, GL_TRUE);
+        } else if (key == GLFW_KEY_F12) {
+            writeProfile(*profiler);
         }
     } else if (action == GLFW_RELEASE) {
         app->onKey(key, false);
@@ -46,10 +116,176 @@ void framebuffer_size_callback(GLFWwindow * window, int width, int height) {
 }
 
 
+struct Options {
+    bool        headless;
+    unsigned    frames;
+    unsigned    meshes;
+    unsigned    threads;
+    unsigned    instances;
+    int         width;
+    int         height;
+    std::string ppmPrefix;
+};
+
+
+void usage(const char * name) {
+    std::cerr << "Usage: " << name << " [--meshes N [--threads N]] [--instances N] [--headless [--frames N] [--size WxH] [--ppm PREFIX]]\n"
+              << "  --meshes N     add N extra meshes to the scene, default 0\n"
+              << "  --threads N    load those meshes on N worker threads, 0 for none, default one per core\n"
+              << "  --instances N  add N instances of a mesh to the scene, default 0\n"
+              << "  --headless     render offscreen without a window, then exit\n"
+              << "  --frames N     number of frames to render, default 300\n"
+              << "  --size WxH     framebuffer size, default 800x600\n"
+              << "  --ppm PREFIX   write each frame to PREFIX0000.ppm and so on" << std::endl;
+}
+
+
+bool parseOptions(int argc, char ** argv, Options & options) {
+    options.headless = false;
+    options.frames = 300;
+    options.meshes = 0;
+    options.threads = std::thread::hardware_concurrency();
+    options.instances = 0;
+    options.width = 800;
+    options.height = 600;
+    for (int i=1; i<argc; ++i) {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--headless")) {
+            options.headless = true;
+        } else if (!strcmp(argv[i], "--frames") && hasValue) {
+            options.frames = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--meshes") && hasValue) {
+            options.meshes = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--threads") && hasValue) {
+            options.threads = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--instances") && hasValue) {
+            options.instances = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--size") && hasValue) {
+            if (sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2 || options.width <= 0 || options.height <= 0) {
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--ppm") && hasValue) {
+            options.ppmPrefix = argv[++i];
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Allocator statistics go to a file if asked for, as JSON lines if it is
+// named .json and CSV otherwise, as does a trace of every allocation for
+// AllocatorBench
+void openAllocatorLogs(GLApp & app, std::ofstream & statsFile, bool & statsJson, std::ofstream & traceFile) {
+    statsJson = false;
+    if (const char * statsPath = getenv("GLDEMO_ALLOC_STATS")) {
+        std::string path(statsPath);
+        statsJson = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+        statsFile.open(path);
+        if (!statsJson) {
+            AllocatorStats::writeCsvHeader(statsFile);
+        }
+    }
+    if (const char * tracePath = getenv("GLDEMO_ALLOC_TRACE")) {
+        traceFile.open(tracePath);
+        app.setAllocatorTrace(&traceFile);
+    }
+}
+
+
+bool checkErrors() {
+    bool ok = true;
+    GLenum err;
+    while ((err = glGetError()) != GL_NO_ERROR) {
+        std::cerr << "OpenGL error: " << err << std::endl;
+        ok = false;
+    }
+    return ok;
 }
 
 
-int main() {
+// Renders a fixed number of frames offscreen with one physics step each, so
+// runs are repeatable, and prints the frame times
+int runHeadless(const Options & options) {
+    try {
+        // Declared in this order so the app goes before the context
+        HeadlessContext context;
+        Profiler profiler;
+        Framebuffer framebuffer(options.width, options.height);
+        framebuffer.bind();
+        ProgramCache programCache(shaderCacheDirectory());
+        GLApp renderer(programCache);
+        renderer.resize(options.width, options.height);
+        renderer.addTestMeshes(options.meshes, options.threads);
+        renderer.addTestInstances(options.instances);
+
+        std::ofstream statsFile;
+        bool statsJson;
+        std::ofstream traceFile;
+        openAllocatorLogs(renderer, statsFile, statsJson, traceFile);
+
+        unsigned updateSection = profiler.section("update");
+        unsigned renderSection = profiler.section("render");
+        unsigned finishSection = profiler.section("finish");
+        RenderCounters counters(profiler);
+        double nextStats = 0.0;
+        bool ok = true;
+        for (unsigned frame=0; frame<options.frames; ++frame) {
+            profiler.beginFrame();
+            {
+                Profiler::CpuScope scope(profiler, updateSection);
+                renderer.update();
+            }
+            {
+                Profiler::CpuScope cpuScope(profiler, renderSection);
+                Profiler::GpuScope gpuScope(profiler, renderSection);
+                renderer.render();
+            }
+            counters.record(profiler, renderer);
+            {
+                // Wait for the GPU so the time covers the whole frame
+                Profiler::CpuScope scope(profiler, finishSection);
+                glFinish();
+            }
+            profiler.endFrame();
+
+            if (!options.ppmPrefix.empty()) {
+                char suffix[16];
+                snprintf(suffix, sizeof(suffix), "%04u.ppm", frame);
+                framebuffer.writePpm(options.ppmPrefix + suffix);
+            }
+            ok = checkErrors() && ok;
+
+            double now = frame * GLApp::PHYSICS_RESOLUTION;
+            if (statsFile.is_open() && now >= nextStats) {
+                renderer.writeAllocatorStats(statsFile, now, statsJson);
+                nextStats = now + STATS_INTERVAL;
+            }
+        }
+        framebuffer.unbind();
+
+        programCache.update();
+        programCache.writeSummary(std::cout);
+        renderer.writeShaderStats(std::cout);
+        std::cout << "frames " << options.frames
+                  << " size " << options.width << "x" << options.height
+                  << " p50 " << profiler.percentile(0.5) << "ms"
+                  << " p95 " << profiler.percentile(0.95) << "ms"
+                  << " p99 " << profiler.percentile(0.99) << "ms"
+                  << " max " << profiler.percentile(1.0) << "ms" << std::endl;
+        if (getenv("GLDEMO_PROFILE")) {
+            writeProfile(profiler);
+        }
+        return ok ? 0 : 1;
+    } catch (const std::exception & e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
+
+
+int runWindowed(const Options & options) {
     // Initialize GLFW
     if (!glfwInit()) {
         return 1;
@@ -91,28 +327,45 @@ int main() {
             return 1;
         }
         glGetError(); // glew is odd an leaves behind an error
+        GLState::invalidate();
 
         // Setup app
         glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
         int width, height;
         glfwGetFramebufferSize(window, &width, &height);
-        app = std::unique_ptr<GLApp>(new GLApp());
+        ProgramCache programCache(shaderCacheDirectory());
+        app = std::unique_ptr<GLApp>(new GLApp(programCache));
         app->resize(width, height);
+        app->addTestMeshes(options.meshes, options.threads);
+        app->addTestInstances(options.instances);
+        profiler = std::unique_ptr<Profiler>(new Profiler());
+        unsigned updateSection = profiler->section("update");
+        unsigned renderSection = profiler->section("render");
+        unsigned swapSection = profiler->section("swap");
+        unsigned pollSection = profiler->section("poll");
+        RenderCounters counters(*profiler);
         glfwSetFramebufferSizeCallback(window, &framebuffer_size_callback);
         glfwSetCursorPosCallback(window, &cursor_pos_callback);
         glfwSetKeyCallback(window, &key_callback);
 
+        std::ofstream statsFile;
+        bool statsJson;
+        std::ofstream traceFile;
+        openAllocatorLogs(*app, statsFile, statsJson, traceFile);
+
         // Show the window
         glfwShowWindow(window);
 
         // Loop until the user closes the window
         double now = glfwGetTime();
         double lag = 0.0;
+        double nextStats = now;
         while (!glfwWindowShouldClose(window)) {
             // Find how much time has elapsed since previous render
             double newTs = glfwGetTime();
             double dt = newTs - now;
             now = newTs;
+            profiler->beginFrame();
 
             int width, height;
             glfwGetFramebufferSize(window, &width, &height);
@@ -120,34 +373,81 @@ int main() {
 
             // Run physics steps
             lag += dt;
-            while (lag >= GLApp::PHYSICS_RESOLUTION) {
-                app->update();
-                lag -= GLApp::PHYSICS_RESOLUTION;
+            {
+                Profiler::CpuScope scope(*profiler, updateSection);
+                while (lag >= GLApp::PHYSICS_RESOLUTION) {
+                    app->update();
+                    lag -= GLApp::PHYSICS_RESOLUTION;
+                }
             }
 
             // Render
             // TODO should get a new timestamp and provide a lerp
-            app->render();
+            {
+                Profiler::CpuScope cpuScope(*profiler, renderSection);
+                Profiler::GpuScope gpuScope(*profiler, renderSection);
+                app->render();
+            }
+            counters.record(*profiler, *app);
 
             // Swap front and back buffers
-            glfwSwapBuffers(window);
+            {
+                Profiler::CpuScope scope(*profiler, swapSection);
+                glfwSwapBuffers(window);
+            }
 
             // Poll for and process events
-            glfwPollEvents();
+            {
+                Profiler::CpuScope scope(*profiler, pollSection);
+                glfwPollEvents();
+            }
+            profiler->endFrame();
 
             // Check for errors
-            GLenum err;
-            while ((err = glGetError()) != GL_NO_ERROR) {
-                std::cerr << "OpenGL error: " << err << std::endl;
+            checkErrors();
+
+            // Periodically dump allocator statistics
+            if (statsFile.is_open() && now >= nextStats) {
+                app->writeAllocatorStats(statsFile, now, statsJson);
+                statsFile.flush();
+                nextStats = now + STATS_INTERVAL;
             }
         }
 
+        if (getenv("GLDEMO_PROFILE")) {
+            writeProfile(*profiler);
+        }
+        // Keep whatever finished building, but only report on it when
+        // looking into performance or the cache
+        programCache.update();
+        if (getenv("GLDEMO_PROFILE") || getenv("GLDEMO_SHADER_CACHE")) {
+            programCache.writeSummary(std::cout);
+            app->writeShaderStats(std::cout);
+        }
+
+        // Both hold GL objects, so go before the context does
+        profiler.reset();
+        app.reset();
         glfwTerminate();
     } catch (const std::exception & e) {
         std::cerr << "Error: " << e.what() << std::endl;
+        profiler.reset();
+        app.reset();
         glfwTerminate();
         return 1;
     }
     return 0;
 }
 
+
+}
+
+
+int main(int argc, char ** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        usage(argv[0]);
+        return 1;
+    }
+    return options.headless ? runHeadless(options) : runWindowed(options);
+}